@@ -27,11 +27,23 @@
 #include <linux/writeback.h>
 #include <linux/page-flags.h>
 #include <linux/swap.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
+#include <linux/srcu.h>
+#include <linux/rbtree.h>
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+#include <linux/jump_label.h>
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#include <linux/sched/clock.h>
+#endif
 
 #include <asm/system.h>
 #include <asm/segment.h>
 #include <asm/mman.h>
 
+#include "nvfs_user.h"
+
 extern int nvfs_debug_lvl;
 
 #define LOGIT(lvl, ...) do {						\
@@ -44,6 +56,7 @@ extern int nvfs_debug_lvl;
 		printk(KERN_NOTICE "In %s\n", __FUNCTION__);		\
 } while (0)
 
+/* for functions returning an integer */
 #define EXIT_RET(a) do {						\
 	if (nvfs_debug_lvl)						\
 		printk(KERN_NOTICE "Leaving %s with %X\n",		\
@@ -51,6 +64,14 @@ extern int nvfs_debug_lvl;
 	return(a);							\
 } while (0); }
 
+/* for functions returning a pointer */
+#define EXIT_RET_PTR(a) do {						\
+	if (nvfs_debug_lvl)						\
+		printk(KERN_NOTICE "Leaving %s with %p\n",		\
+				__FUNCTION__, (void *)(a));		\
+	return(a);							\
+} while (0); }
+
 #define EXIT_NORET do {							\
 	if (nvfs_debug_lvl)						\
 		printk(KERN_ERR "Leaving %s\n", __FUNCTION__);		\
@@ -71,35 +92,275 @@ extern int nvfs_debug_lvl;
 #define DEFAULT_POLLMASK (POLLIN | POLLOUT | POLLRDNORM | POLLWRNORM)
 #endif
 
+/* before 2.6.34 SRCU readers used rcu_dereference */
+#ifndef srcu_dereference
+#define srcu_dereference(p, sp) rcu_dereference(p)
+#endif
+
 #define MIN(x, y) ((x < y) ? (x) : (y))
 #define MAX(x, y) ((x > y) ? (x) : (y))
 
+/*
+ * An event describes a hooked operation independently of its calling
+ * convention. Pointers other than @sb and @upper are to lower objects.
+ * For synchronous delivery they are only valid for the duration of the
+ * call; deferred delivery holds references on @upper, @inode, @dentry
+ * and @dentry2 until every consumer has seen the event.
+ */
+struct nvfs_event {
+	unsigned int	op;		/* NVFS_OP_* */
+	unsigned int	flags;
+	struct super_block *sb;		/* nvfs superblock */
+	struct dentry	*upper;		/* nvfs dentry the op came through */
+	struct inode	*inode;		/* inode the op applies to */
+	struct dentry	*dentry;	/* dentry the op applies to, or NULL */
+	struct dentry	*dentry2;	/* link, copy source; rename target */
+	loff_t		offset;		/* file offset or new size */
+	loff_t		offset2;	/* copy or clone source offset */
+	size_t		count;		/* length of the range at @offset */
+	int		mode;		/* mode, open flags or ia_valid */
+	int		result;		/* NVFS_EVF_POST: op's return value */
+};
+
+/*
+ * Filter programs. A consumer may attach a program that is run over an
+ * operation before any of its functions are called for it; unless the
+ * program returns nonzero the consumer never sees the operation, and no
+ * copy of an event is made on its behalf. A program is a list of
+ * instructions working on a single 64 bit accumulator, in the manner of
+ * classic BPF. Registration rejects programs that use unknown opcodes or
+ * fields, jump out of bounds or can fall off the end, and since jumps
+ * only go forward every run ends within len steps.
+ */
+enum {
+	NVFS_FLT_LD,		/* A = field k */
+	NVFS_FLT_JEQ,		/* skip jt if A == k, else jf */
+	NVFS_FLT_JGT,		/* A > k */
+	NVFS_FLT_JGE,		/* A >= k */
+	NVFS_FLT_JSET,		/* A & k */
+	NVFS_FLT_JSUFFIX,	/* name ends with str */
+	NVFS_FLT_JPREFIX,	/* name starts with str */
+	NVFS_FLT_RET,		/* return k */
+};
+
+/*
+ * Fields for NVFS_FLT_LD. Name, type, owner and size are those of the
+ * nvfs dentry the operation came through, if any; offset and count are
+ * zero for operations without a range.
+ */
+enum {
+	NVFS_FLD_OP,		/* NVFS_OP_* */
+	NVFS_FLD_FLAGS,		/* NVFS_EVF_*, zero for raw callbacks */
+	NVFS_FLD_TYPE,		/* S_IFMT bits, zero if negative */
+	NVFS_FLD_UID,
+	NVFS_FLD_GID,
+	NVFS_FLD_SIZE,
+	NVFS_FLD_OFFSET,
+	NVFS_FLD_COUNT,
+	NVFS_FLD_MAX
+};
+
+#define NVFS_FILTER_MAX_INSNS	64
+
+struct nvfs_filter_insn {
+	u16		code;
+	u8		jt;
+	u8		jf;
+	u64		k;
+	const char	*str;	/* NVFS_FLT_JSUFFIX, NVFS_FLT_JPREFIX */
+};
+
+#define NVFS_FLT_STMT(_code, _k) \
+	{ .code = NVFS_FLT_##_code, .k = (_k) }
+#define NVFS_FLT_JUMP(_code, _k, _jt, _jf) \
+	{ .code = NVFS_FLT_##_code, .k = (_k), .jt = (_jt), .jf = (_jf) }
+#define NVFS_FLT_NAME(_code, _str, _jt, _jf) \
+	{ .code = NVFS_FLT_##_code, .str = (_str), .jt = (_jt), .jf = (_jf) }
+
+struct nvfs_filter {
+	unsigned int			len;
+	const struct nvfs_filter_insn	*insns;
+};
+
+/* nvfs_callback_info flags */
+#define NVFS_CB_ASYNC	0x0001	/* deliver events from worker threads */
+/* set by the watchdog when over budget, cleared by registering again */
+#define NVFS_CB_SLOW	0x0002	/* events are deferred as for ASYNC */
+#define NVFS_CB_SKIP	0x0004	/* not called at all */
+
+/*
+ * Time spent in a consumer, per operation, as a log2 histogram: bucket 0
+ * counts calls under 256ns and bucket i > 0 those under 256ns << i. The
+ * last bucket takes everything slower.
+ */
+#define NVFS_HIST_BUCKETS	24
+
+struct nvfs_cb_pcpu {
+	u64	hist[NVFS_OP_MAX][NVFS_HIST_BUCKETS];
+	u64	ns[NVFS_OP_MAX];	/* total time */
+};
+
+struct nvfs_cb_stats {
+	struct nvfs_cb_pcpu	*pcpu;	/* per CPU */
+	/* watchdog: histogram over every op at its last pass */
+	u64			seen[NVFS_HIST_BUCKETS];
+};
+
 struct nvfs_callback_info {
 	struct list_head		next;
+	const char			*name;	/* for stats, or NULL */
 	struct file_operations		*reg_f_op;
 	struct inode_operations		*reg_i_op;
 	struct inode_operations 	*dir_i_op;
 	struct inode_operations		*sym_i_op;
 	struct super_operations		*sb_op;
 	struct dentry_operations	*d_op;
+	unsigned int			flags;
+	void				(*event)(struct nvfs_callback_info *,
+						const struct nvfs_event *);
+	void				(*post)(struct nvfs_callback_info *,
+						const struct nvfs_event *);
+	/* run before any of the above, or NULL; kept until unregister */
+	const struct nvfs_filter	*filter;
+	/* set by registration */
+	struct super_block		*sb;	/* bound mount, or NULL */
+	struct dentry			*root;	/* bound subtree, or NULL */
+	struct nvfs_cb_stats		*stats;
+};
+
+/* the handler for an event: ->post once the op is done, else ->event */
+#define NVFS_EV_HANDLER(cb, post) ((post) ? (cb)->post : (cb)->event)
+/* index of the matching consumer list in nvfs_dispatch */
+#define NVFS_EV_LIST(post, async) (((post) ? 2 : 0) | ((async) ? 1 : 0))
+
+/*
+ * Slot numbers of the hookable members of each kind of operations
+ * table, NVFS_fop_read and so on; see nvfs_slots.h.
+ */
+#define NVFS_FOP_SLOT(func) NVFS_fop_##func,
+enum nvfs_fop_slot {
+#include "nvfs_slots.h"
+	NVFS_fop_NR
+};
+#undef NVFS_FOP_SLOT
+#define NVFS_IOP_SLOT(func) NVFS_iop_##func,
+enum nvfs_iop_slot {
+#include "nvfs_slots.h"
+	NVFS_iop_NR
+};
+#undef NVFS_IOP_SLOT
+#define NVFS_SOP_SLOT(func) NVFS_sop_##func,
+enum nvfs_sop_slot {
+#include "nvfs_slots.h"
+	NVFS_sop_NR
+};
+#undef NVFS_SOP_SLOT
+#define NVFS_DOP_SLOT(func) NVFS_dop_##func,
+enum nvfs_dop_slot {
+#include "nvfs_slots.h"
+	NVFS_dop_NR
+};
+#undef NVFS_DOP_SLOT
+
+/* an operations table seen generically, and the kind of each table */
+typedef void (*nvfs_fn_t)(void);
+
+#define NVFS_OPS_TYPE(op) typeof(*((struct nvfs_callback_info *)0)->op)
+#define NVFS_KIND_reg_f_op	fop
+#define NVFS_KIND_reg_i_op	iop
+#define NVFS_KIND_dir_i_op	iop
+#define NVFS_KIND_sym_i_op	iop
+#define NVFS_KIND_sb_op		sop
+#define NVFS_KIND_d_op		dop
+#define NVFS_SLOT(op, func) __NVFS_SLOT(NVFS_KIND_##op, func)
+#define __NVFS_SLOT(kind, func) ___NVFS_SLOT(kind, func)
+#define ___NVFS_SLOT(kind, func) NVFS_##kind##_##func
+
+/* a registered function, the subtree it is bound to and its filter */
+struct nvfs_hook {
+	nvfs_fn_t			fn;
+	struct dentry			*root;
+	const struct nvfs_filter	*filter;
+	struct nvfs_callback_info	*cb;	/* registered it */
 };
 
+/*
+ * Dispatch snapshot of one mount, rebuilt whenever a module registers or
+ * unregisters for it or for every mount. For each operation slot there
+ * is either NULL (nobody hooks it) or a vector of the registered
+ * functions, in list order, ended by a NULL fn.
+ */
+struct nvfs_dispatch {
+	struct nvfs_hook		*reg_f_op[NVFS_fop_NR];
+	struct nvfs_hook		*reg_i_op[NVFS_iop_NR];
+	struct nvfs_hook		*dir_i_op[NVFS_iop_NR];
+	struct nvfs_hook		*sym_i_op[NVFS_iop_NR];
+	struct nvfs_hook		*sb_op[NVFS_sop_NR];
+	struct nvfs_hook		*d_op[NVFS_dop_NR];
+	/* NULL terminated consumer lists by NVFS_EV_LIST, or NULL */
+	struct nvfs_callback_info	**ev[4];
+	/* chains snapshots waiting to be freed */
+	struct nvfs_dispatch		*stale;
+	struct nvfs_hook		hooks[0];
+};
+
+struct nvfs_bloom;
+
 struct nvfs_inode_info {
-	struct inode	*wii_inode;
-	struct inode	vfs_inode;
+	struct inode		*wii_inode;
+	/* pending coalesced write range, see nvfs_coalesce.c */
+	spinlock_t		wii_lock;
+	struct dentry		*wii_wdentry;	/* written through, or NULL */
+	loff_t			wii_wstart;
+	loff_t			wii_wend;
+	unsigned long		wii_wtime;	/* jiffies the range opened */
+	struct list_head	wii_wlist;	/* on the pending list */
+	/* dirty extents since the last fetch, see nvfs_dirty.c */
+	struct rb_root		wii_dirty;
+	unsigned int		wii_ndirty;
+	unsigned int		wii_dflags;	/* NVFS_DIRTY_* */
+	loff_t			wii_dsize;	/* lowest size cut to */
+	/* names a directory has, see nvfs_bloom.c; read under RCU */
+	struct nvfs_bloom	*wii_bloom;
+	unsigned int		wii_bmisses;	/* lower misses so far */
+	/* files with write combining buffers, see nvfs_wcombine.c */
+	struct mutex		wii_wc_mutex;
+	struct list_head	wii_wcombine;
+	struct inode		vfs_inode;
 };
 
 struct nvfs_dentry_info {
 	struct dentry	*wdi_dentry;
 	struct vfsmount	*wdi_mnt;
+	struct rcu_head	wdi_rcu;	/* RCU-walk may still read us */
+	unsigned long	wdi_time;	/* jiffies last found valid */
 };
 
+struct nvfs_gcommit;
+
 struct nvfs_sb_info {
 	struct super_block	*wsi_sb;
+	/* the rest is under nvfs_cb_mutex */
+	struct nvfs_dispatch	*wsi_dispatch;	/* read under nvfs_cb_srcu */
+	struct list_head	wsi_callbacks;	/* bound to this mount */
+	struct list_head	wsi_next;	/* on nvfs_supers */
+	atomic_t		wsi_ev_queued;	/* deferred, not delivered */
+	/* fsync group commit, see nvfs_gcommit.c */
+	spinlock_t		wsi_gc_lock;
+	struct mutex		wsi_gc_mutex;	/* held while syncing */
+	struct nvfs_gcommit	*wsi_gc_open;	/* batch taking joiners */
+	unsigned int		wsi_gc_us;	/* batch window; 0 is off */
+	/* revalidation windows in ms, from the mount options; 0 is none */
+	unsigned int		wsi_pos_ttl;
+	unsigned int		wsi_neg_ttl;
 };
 
+struct nvfs_wcombine;
+
 struct nvfs_file_info {
-	struct file	*wfi_file;
+	struct file		*wfi_file;
+	/* write combining buffer, see nvfs_wcombine.c; NULL unless asked */
+	struct nvfs_wcombine	*wfi_wcombine;
 };
 
 #define FILE_TO_PRIVATE(file) ((struct nvfs_file_info *)((file)->private_data))
@@ -128,7 +389,13 @@ struct nvfs_file_info {
 #define nvfs_lower_dentry(dentry) DENTRY_TO_LOWER(dentry)
 #define DENTRY_TO_LVFSMNT(dent) (DENTRY_TO_PRIVATE(dent)->wdi_mnt)
 
-extern struct list_head			nvfs_callbacks;
+extern struct nvfs_ring			**nvfs_rings;
+extern struct srcu_struct		nvfs_cb_srcu;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+DECLARE_STATIC_KEY_FALSE(nvfs_hooks_key);
+#else
+extern int				nvfs_hooks_enabled;
+#endif
 extern struct kmem_cache		*nvfs_inode_cachep;
 extern struct file_operations		nvfs_main_fops;
 extern struct file_operations		nvfs_dir_fops;
@@ -141,12 +408,217 @@ extern struct vm_operations_struct	nvfs_shared_vmops;
 extern struct vm_operations_struct	nvfs_private_vmops;
 extern struct address_space_operations	nvfs_aops;
 
+extern struct inode *nvfs_iget(struct super_block *sb,
+		struct inode *lower_inode);
 extern int nvfs_interpose(struct dentry*, struct dentry*,
 		struct super_block*, int);
 extern int nvfs_init_inodecache(void);
 extern void nvfs_destroy_inodecache(void);
 extern int register_nvfs_callback(struct nvfs_callback_info *cb, int head);
+extern int register_nvfs_callback_sb(struct nvfs_callback_info *cb,
+		struct super_block *sb, int head);
+extern int register_nvfs_callback_subtree(struct nvfs_callback_info *cb,
+		struct dentry *root, int head);
+extern int nvfs_attach_sb(struct super_block *sb);
+extern void nvfs_detach_sb(struct super_block *sb);
 extern int unregister_nvfs_callback(struct nvfs_callback_info *cb);
+extern void nvfs_hooks_get(void);
+extern void nvfs_hooks_put(void);
+extern void nvfs_event_notify(struct nvfs_event *ev);
+extern void nvfs_event_flush(struct super_block *sb);
+extern int nvfs_event_init(void);
+extern void nvfs_event_exit(void);
+extern void nvfs_ring_write(const struct nvfs_event *ev);
+extern int nvfs_ring_init(void);
+extern void nvfs_ring_exit(void);
+extern int nvfs_coalesce_wants(size_t count);
+extern void nvfs_coalesce_write(struct inode *inode, struct dentry *dentry,
+		loff_t pos, size_t count, ssize_t res, unsigned int flags);
+extern void nvfs_coalesce_flush(struct inode *inode);
+extern void nvfs_coalesce_flush_sb(struct super_block *sb);
+extern void nvfs_coalesce_exit(void);
+extern void nvfs_dirty_add(struct inode *inode, loff_t start, loff_t end);
+extern void nvfs_dirty_resize(struct inode *inode, loff_t from, loff_t to);
+extern void nvfs_dirty_fallocate(struct inode *inode, loff_t offset,
+		loff_t len, loff_t from);
+extern unsigned int nvfs_dirty_fetch(struct inode *inode,
+		struct nvfs_extent *ext, unsigned int *count, loff_t *size);
+extern int nvfs_dirty_ioctl(struct inode *inode, void __user *uarg);
+extern void nvfs_dirty_free(struct inode *inode);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+extern ssize_t nvfs_wcombine_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos, int append, int pass);
+#else
+extern ssize_t nvfs_wcombine_write(struct file *file, struct iov_iter *buf,
+		size_t count, loff_t *ppos, int append, int pass);
+#endif
+extern int nvfs_wcombine_flush(struct file *file);
+extern int nvfs_wcombine_flush_inode(struct inode *inode);
+extern int nvfs_wcombine_set(struct file *file, unsigned int size);
+extern void nvfs_wcombine_release(struct file *file);
+extern int nvfs_gcommit_wanted(struct super_block *sb);
+extern int nvfs_gcommit_fsync(struct super_block *sb, struct file *lower_file);
+extern int nvfs_bloom_absent(struct inode *dir, const struct qstr *name);
+extern void nvfs_bloom_add(struct inode *dir, const struct qstr *name);
+extern void nvfs_bloom_miss(struct dentry *dentry);
+extern void nvfs_bloom_free(struct inode *inode);
+extern int nvfs_callbacks_walk(int (*fn)(struct nvfs_callback_info *,
+			void *), void *arg);
+extern struct nvfs_cb_stats *nvfs_stats_alloc(void);
+extern void nvfs_stats_free(struct nvfs_cb_stats *stats);
+extern void nvfs_stats_account(struct nvfs_callback_info *cb,
+		unsigned int op, u64 start);
+extern int nvfs_stats_init(void);
+extern void nvfs_stats_exit(void);
+extern int nvfs_filter_check(const struct nvfs_filter *f);
+extern int nvfs_filter_run(const struct nvfs_filter *f,
+		const struct nvfs_event *ev);
+
+/*
+ * True while anything consumes hook output. Patched into a jump where
+ * static keys exist, so an idle mount pays a nop per hook site. That is
+ * 4.3 on, which the rest of the tree does not build on yet, so the key
+ * has never been compiled; every kernel nvfs builds on tests the flag.
+ */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+#define nvfs_hooks_active() static_branch_unlikely(&nvfs_hooks_key)
+#else
+#define nvfs_hooks_active() unlikely(nvfs_hooks_enabled)
+#endif
+
+/* start of a consumer call, for nvfs_stats_account */
+static inline u64
+nvfs_stats_clock(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,37)
+	return local_clock();
+#else
+	return sched_clock();
+#endif
+}
+
+/*
+ * Whether a consumer bound to @root sees an operation on @dentry. An
+ * operation with no dentry (permission, statfs) is only seen by
+ * consumers of the whole mount.
+ */
+static inline int
+nvfs_in_subtree(struct dentry *dentry, struct dentry *root)
+{
+	return !root || (dentry && is_subdir(dentry, root));
+}
+
+/* whether a consumer with @root and @filter sees @ev */
+static inline int
+nvfs_wants(struct dentry *root, const struct nvfs_filter *filter,
+		const struct nvfs_event *ev)
+{
+	return nvfs_in_subtree(ev->upper, root) &&
+		(!filter || nvfs_filter_run(filter, ev));
+}
+
+/*
+ * Callback dispatch shared by the F_CB, I_CB, D_CB and S_CB macros, for
+ * an operation on nvfs superblock @_sb through nvfs dentry @_ctx (or
+ * NULL), covering @_cnt bytes at @_off if it has a range. The snapshot
+ * is read under SRCU rather than plain RCU since callbacks are allowed
+ * to sleep; unregister waits for any reader still inside a callback
+ * before it returns. An operation nobody hooks on this mount costs one
+ * load, and nothing at all while no module is registered anywhere.
+ * Filters see the operation as an event carrying only those fields.
+ */
+#define NVFS_CB_RANGE(_sb, _ctx, _off, _cnt, _tab, func, ...) do {	\
+	struct nvfs_dispatch	*__d;					\
+	struct nvfs_hook	*__h;					\
+	int			__cb_idx;				\
+	if (!nvfs_hooks_active())					\
+		break;							\
+	__cb_idx = srcu_read_lock(&nvfs_cb_srcu);			\
+	__d = srcu_dereference(SUPERBLOCK_TO_PRIVATE(_sb)->wsi_dispatch, \
+			&nvfs_cb_srcu);					\
+	if (__d && (__h = __d->_tab[NVFS_SLOT(_tab, func)]) != NULL) {	\
+		struct nvfs_event	__fev = {			\
+			.op	= NVFS_OP_##func,			\
+			.sb	= (_sb),				\
+			.upper	= (_ctx),				\
+			.offset	= (_off),				\
+			.count	= (_cnt),				\
+		};							\
+		for (; __h->fn; __h++) {				\
+			u64	__t;					\
+			if (!nvfs_wants(__h->root, __h->filter, &__fev)) \
+				continue;				\
+			__t = nvfs_stats_clock();			\
+			((typeof(((NVFS_OPS_TYPE(_tab) *)0)->func))	\
+				__h->fn)(__VA_ARGS__);			\
+			nvfs_stats_account(__h->cb, NVFS_OP_##func, __t); \
+		}							\
+	}								\
+	srcu_read_unlock(&nvfs_cb_srcu, __cb_idx);			\
+} while (0)
+
+#define NVFS_CB(_sb, _ctx, _tab, func, ...) \
+	NVFS_CB_RANGE(_sb, _ctx, 0, 0, _tab, func, __VA_ARGS__)
+
+/*
+ * Whether anyone hooks @func in @_tab on nvfs superblock @_sb. An
+ * operation in RCU-walk asks before it would call callbacks, which may
+ * sleep, and drops back to ref-walk only if there are some.
+ */
+#define NVFS_HOOKED(_sb, _tab, func) ({					\
+	struct nvfs_dispatch	*__d;					\
+	int			__hooked = 0,				\
+				__cb_idx;				\
+	if (nvfs_hooks_active()) {					\
+		__cb_idx = srcu_read_lock(&nvfs_cb_srcu);		\
+		__d = srcu_dereference(					\
+			SUPERBLOCK_TO_PRIVATE(_sb)->wsi_dispatch,	\
+			&nvfs_cb_srcu);					\
+		__hooked = __d && __d->_tab[NVFS_SLOT(_tab, func)];	\
+		srcu_read_unlock(&nvfs_cb_srcu, __cb_idx);		\
+	}								\
+	__hooked;							\
+})
+
+/*
+ * Hand an event for operation @_op, which came in through nvfs dentry
+ * @_upper, to the ->event consumers. Trailing arguments are designated
+ * initializers for the remaining fields.
+ */
+#define NVFS_EVENT(_op, _upper, _inode, _dentry, ...) do {		\
+	if (nvfs_hooks_active()) {					\
+		struct nvfs_event	__ev = {			\
+			.op	= NVFS_OP_##_op,			\
+			.sb	= (_upper)->d_sb,			\
+			.upper	= (_upper),				\
+			.inode	= (_inode),				\
+			.dentry	= (_dentry),				\
+			__VA_ARGS__					\
+		};							\
+		nvfs_event_notify(&__ev);				\
+	}								\
+} while (0)
+
+/*
+ * The same once the lower operation has returned @_result, for the
+ * ->post consumers. @_inode should be the lower inode as the operation
+ * left it: the new inode for an operation that creates one.
+ */
+#define NVFS_EVENT_POST(_op, _result, _upper, _inode, _dentry, ...) do { \
+	if (nvfs_hooks_active()) {					\
+		struct nvfs_event	__ev = {			\
+			.op	= NVFS_OP_##_op,			\
+			.sb	= (_upper)->d_sb,			\
+			.upper	= (_upper),				\
+			.inode	= (_inode),				\
+			.dentry	= (_dentry),				\
+			.result	= (_result),				\
+			__VA_ARGS__					\
+		};							\
+		__ev.flags |= NVFS_EVF_POST;				\
+		nvfs_event_notify(&__ev);				\
+	}								\
+} while (0)
 
 #define copy_inode_size(dst, src) do {					\
 	i_size_write(dst, i_size_read((struct inode *) src));		\
@@ -166,6 +638,23 @@ extern int unregister_nvfs_callback(struct nvfs_callback_info *cb);
 #define ND_TO_MNT(nd) nd.path.mnt
 #endif
 
+/*
+ * Whether a lookup or d_revalidate may be for a name about to be
+ * created or renamed over, from its nameidata (flags from 3.6 on). The
+ * negative lookup filter is not trusted for those; a caller that passes
+ * no nameidata, such as nfsd, might be creating.
+ */
+#ifndef LOOKUP_RENAME_TARGET
+#define LOOKUP_RENAME_TARGET	0
+#endif
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
+#define NVFS_FOR_CREATE(nd)	\
+	(!(nd) || ((nd)->flags & (LOOKUP_CREATE | LOOKUP_RENAME_TARGET)))
+#else
+#define NVFS_FOR_CREATE(flags)	\
+	((flags) & (LOOKUP_CREATE | LOOKUP_RENAME_TARGET))
+#endif
+
 #define NVFS_ND_DECLARATIONS	struct dentry *saved_dentry = NULL;	\
 				struct vfsmount *saved_vfsmount = NULL;
 
@@ -0,0 +1,328 @@
+#include "nvfs.h"
+#include <linux/jhash.h>
+
+/*
+ * Negative lookup filter. With nvfs_bloom_bits set, a directory that
+ * keeps being asked for names it does not have gets a Bloom filter of
+ * the names it does have, filled from one readdir of the lower
+ * directory and kept up by nvfs's own create, link, symlink, mkdir,
+ * mknod and rename. A name the filter rules out is answered with a
+ * negative dentry that has no lower dentry at all: no lower lock, no
+ * lower lookup, no allocation. d_revalidate keeps such a dentry only as
+ * long as the filter still rules its name out, and never for a lookup
+ * that is about to create or rename over the name; such lookups always
+ * go to the lower directory, so a name created there behind our back is
+ * found and met as it would be on the lower filesystem.
+ *
+ * Names that go away stay in the filter, which only costs a lookup.
+ * Once more names have gone in than the filter holds with few false
+ * positives it is dropped, to be rebuilt at the next misses; one that
+ * fills up while it is built is kept, unused, for the life of the
+ * inode, so a huge directory is only read once.
+ *
+ * A name created in the lower directory other than through this mount
+ * may be taken for missing, hence off by default. Lower directories that
+ * hash or compare names their own way never get a filter.
+ */
+
+static unsigned int nvfs_bloom_bits = 0;
+module_param(nvfs_bloom_bits, uint, 0644);
+MODULE_PARM_DESC(nvfs_bloom_bits,
+		"Bits in each directory's negative lookup filter (0 disables)");
+
+/* lower misses in a directory before its filter is built */
+#define NVFS_BLOOM_MISSES	4
+/* probes per name, and bits per name it is sized for (~1% false) */
+#define NVFS_BLOOM_K		6
+#define NVFS_BLOOM_RATIO	10
+
+struct nvfs_bloom {
+	struct rcu_head	rcu;
+	unsigned int	bits;		/* a power of two */
+	unsigned int	max;		/* names before it is too full */
+	atomic_t	names;		/* names put in, with repeats */
+	int		ready;		/* filled, so misses are real */
+	unsigned long	map[0];
+};
+
+/* where a readdir puts the names it finds */
+struct nvfs_bloom_fill {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+	struct dir_context	ctx;	/* first, see nvfs_bloom_filldir */
+#endif
+	struct nvfs_bloom	*b;
+	unsigned int		seen;	/* names in this pass */
+};
+
+/**
+ * nvfs_bloom_put - set a name's bits
+ * @b: filter
+ * @name: name
+ * @len: its length
+ *
+ * Returns 1 if the filter has had more names than it was sized for.
+ */
+static int
+nvfs_bloom_put(struct nvfs_bloom *b, const char *name, unsigned int len)
+{
+	int	i;
+	u32	h1 = jhash(name, len, 0),
+		h2 = jhash(name, len, h1) | 1;
+
+	for (i = 0; i < NVFS_BLOOM_K; i++)
+		set_bit((h1 + i * h2) & (b->bits - 1), b->map);
+
+	return atomic_inc_return(&b->names) > b->max;
+}
+
+/**
+ * nvfs_bloom_has - whether a name may be in a filter
+ * @b: filter
+ * @name: name
+ * @len: its length
+ */
+static int
+nvfs_bloom_has(struct nvfs_bloom *b, const char *name, unsigned int len)
+{
+	int	i;
+	u32	h1 = jhash(name, len, 0),
+		h2 = jhash(name, len, h1) | 1;
+
+	for (i = 0; i < NVFS_BLOOM_K; i++)
+		if (!test_bit((h1 + i * h2) & (b->bits - 1), b->map))
+			return 0;
+	return 1;
+}
+
+/**
+ * nvfs_bloom_free_rcu - free a filter once RCU readers are done with it
+ * @head: its rcu head
+ *
+ * exit_nvfs_fs waits for the last of these with rcu_barrier.
+ */
+static void
+nvfs_bloom_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct nvfs_bloom, rcu));
+}
+
+/**
+ * nvfs_bloom_drop - take a filter that is too full off its directory
+ * @wi: directory
+ * @b: its filter
+ */
+static void
+nvfs_bloom_drop(struct nvfs_inode_info *wi, struct nvfs_bloom *b)
+{
+	ENTER;
+
+	if (cmpxchg(&wi->wii_bloom, b, NULL) == b) {
+		wi->wii_bmisses = 0;
+		call_rcu(&b->rcu, nvfs_bloom_free_rcu);
+	}
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_bloom_absent - whether a name is surely not in a directory
+ * @dir: nvfs directory inode
+ * @name: name looked up
+ *
+ * Does not block, for RCU-walk.
+ */
+int
+nvfs_bloom_absent(struct inode *dir, const struct qstr *name)
+{
+	int			absent = 0;
+	struct nvfs_bloom	*b;
+
+	rcu_read_lock();
+	b = rcu_dereference(INODE_TO_PRIVATE(dir)->wii_bloom);
+	if (b && ACCESS_ONCE(b->ready)) {
+		smp_rmb();
+		absent = !nvfs_bloom_has(b, name->name, name->len);
+	}
+	rcu_read_unlock();
+
+	return absent;
+}
+
+/**
+ * nvfs_bloom_add - note that a directory has a name
+ * @dir: nvfs directory inode
+ * @name: name created in it, or found there
+ */
+void
+nvfs_bloom_add(struct inode *dir, const struct qstr *name)
+{
+	struct nvfs_inode_info	*wi = INODE_TO_PRIVATE(dir);
+	struct nvfs_bloom	*b;
+
+	ENTER;
+
+	rcu_read_lock();
+	b = rcu_dereference(wi->wii_bloom);
+	/* one being filled may fill up; it is judged when it is done */
+	if (b && nvfs_bloom_put(b, name->name, name->len) &&
+	    ACCESS_ONCE(b->ready))
+		nvfs_bloom_drop(wi, b);
+	rcu_read_unlock();
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_bloom_filldir - put a name from the lower readdir in the filter
+ * @arg: the nvfs_bloom_fill
+ * @name: name found
+ * @len: its length
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,19,0)
+static int
+nvfs_bloom_filldir(void *arg, const char *name, int len, loff_t off,
+		u64 ino, unsigned int type)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(6,1,0)
+static int
+nvfs_bloom_filldir(struct dir_context *arg, const char *name, int len,
+		loff_t off, u64 ino, unsigned int type)
+#else
+static bool
+nvfs_bloom_filldir(struct dir_context *arg, const char *name, int len,
+		loff_t off, u64 ino, unsigned int type)
+#endif
+{
+	struct nvfs_bloom_fill	*fill = (struct nvfs_bloom_fill *)arg;
+
+	fill->seen++;
+	nvfs_bloom_put(fill->b, name, len);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,1,0)
+	return 0;
+#else
+	return true;
+#endif
+}
+
+/**
+ * nvfs_bloom_fill - read a lower directory's names into a filter
+ * @b: filter, already on the directory so creates go in too
+ * @lower_dir: lower directory
+ * @mnt: its mount
+ */
+static int
+nvfs_bloom_fill(struct nvfs_bloom *b, struct dentry *lower_dir,
+		struct vfsmount *mnt)
+{
+	int			err;
+	struct file		*file;
+	struct nvfs_bloom_fill	fill = {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,11,0)
+		.ctx.actor	= nvfs_bloom_filldir,
+#endif
+		.b		= b,
+	};
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
+	struct path		path = { .mnt = mnt, .dentry = lower_dir };
+#endif
+
+	ENTER;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
+	file = dentry_open(dget(lower_dir), mntget(mnt),
+			O_RDONLY | O_DIRECTORY);
+#else
+	file = dentry_open(&path, O_RDONLY | O_DIRECTORY, current_cred());
+#endif
+	if (IS_ERR(file)) {
+		err = PTR_ERR(file);
+		goto out;
+	}
+
+	/* a filesystem may stop short of the end on any one call */
+	do {
+		fill.seen = 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+		err = vfs_readdir(file, nvfs_bloom_filldir, &fill);
+#else
+		err = iterate_dir(file, &fill.ctx);
+#endif
+	} while (!err && fill.seen);
+
+	fput(file);
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_bloom_miss - count a name the lower directory did not have
+ * @dentry: negative nvfs dentry just looked up
+ *
+ * The filter is built, in this thread, at the NVFS_BLOOM_MISSES'th miss;
+ * a directory missed once or twice is not worth a readdir.
+ */
+void
+nvfs_bloom_miss(struct dentry *dentry)
+{
+	int			err;
+	unsigned int		bits = nvfs_bloom_bits;
+	struct dentry		*parent = dentry->d_parent,
+				*lower_dir = nvfs_lower_dentry(parent);
+	struct nvfs_inode_info	*wi = INODE_TO_PRIVATE(parent->d_inode);
+	struct nvfs_bloom	*b;
+
+	ENTER;
+
+	/* racy, but it only says when to build */
+	if (!bits || wi->wii_bloom || ++wi->wii_bmisses < NVFS_BLOOM_MISSES)
+		goto out;
+	if (lower_dir->d_op &&
+	    (lower_dir->d_op->d_hash || lower_dir->d_op->d_compare))
+		goto out;
+
+	/* round down to a power of two */
+	bits = MAX(bits, BITS_PER_LONG);
+	bits = 1U << (fls(bits) - 1);
+	b = kzalloc(sizeof(*b) + bits / 8, GFP_KERNEL);
+	if (!b)
+		goto out;
+	b->bits = bits;
+	b->max = bits / NVFS_BLOOM_RATIO;
+	atomic_set(&b->names, 0);
+	b->ready = 0;
+	if (cmpxchg(&wi->wii_bloom, NULL, b)) {
+		kfree(b);
+		goto out;
+	}
+
+	err = nvfs_bloom_fill(b, lower_dir, DENTRY_TO_LVFSMNT(parent));
+	if (err) {
+		nvfs_bloom_drop(wi, b);
+		goto out;
+	}
+	if (atomic_read(&b->names) > b->max)
+		goto out;
+	smp_wmb();
+	b->ready = 1;
+out:
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_bloom_free - free the filter of an inode going away
+ * @inode: upper inode
+ */
+void
+nvfs_bloom_free(struct inode *inode)
+{
+	struct nvfs_inode_info	*wi = INODE_TO_PRIVATE(inode);
+
+	ENTER;
+
+	if (wi->wii_bloom) {
+		call_rcu(&wi->wii_bloom->rcu, nvfs_bloom_free_rcu);
+		wi->wii_bloom = NULL;
+	}
+	wi->wii_bmisses = 0;
+
+	EXIT_NORET;
+}
@@ -0,0 +1,298 @@
+#include "nvfs.h"
+#include <linux/workqueue.h>
+
+/*
+ * Write coalescing. Appending writers produce one write event per
+ * write(2), usually a few KB each. With nvfs_coalesce_ms set, the range
+ * of a write is instead merged into a pending range kept on the upper
+ * inode, as long as the two overlap or touch, the result stays within
+ * nvfs_coalesce_bytes and the pending range is younger than the window.
+ * Otherwise the pending range is sent as a single write event flagged
+ * NVFS_EVF_COALESCED and the new write opens the next one. Raw ->write
+ * callbacks are not affected.
+ *
+ * Only what the lower write returned goes into a range, once it has
+ * returned; a write that fails is sent on its own, with its post event.
+ * A pending range is also sent when it ages out, and by
+ * nvfs_event_notify before any other event raised through the inode,
+ * so consumers see a file's events in order. Link and rename also send
+ * the range of the inode they link or replace.
+ */
+
+static int nvfs_coalesce_ms = 0;
+module_param(nvfs_coalesce_ms, int, 0644);
+MODULE_PARM_DESC(nvfs_coalesce_ms,
+		"Merge write events over this many ms (0 disables)");
+
+static int nvfs_coalesce_bytes = 1 << 20;
+module_param(nvfs_coalesce_bytes, int, 0644);
+MODULE_PARM_DESC(nvfs_coalesce_bytes, "Largest coalesced write range");
+
+/* inodes with a pending range, oldest first */
+static LIST_HEAD(nvfs_coalesce_list);
+static DEFINE_SPINLOCK(nvfs_coalesce_lock);
+
+/* inodes taken off the list per pass of nvfs_coalesce_scan */
+#define NVFS_COALESCE_BATCH	32
+
+struct nvfs_wrange {
+	struct dentry	*dentry;
+	loff_t		start;
+	loff_t		end;
+};
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void nvfs_coalesce_work(void *data);
+static DECLARE_WORK(nvfs_coalesce_dwork, nvfs_coalesce_work, NULL);
+#else
+static void nvfs_coalesce_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(nvfs_coalesce_dwork, nvfs_coalesce_work);
+#endif
+
+static inline unsigned long
+nvfs_coalesce_window(void)
+{
+	return msecs_to_jiffies(MAX(nvfs_coalesce_ms, 1));
+}
+
+/**
+ * nvfs_coalesce_take - detach the pending range of an inode
+ * @wi: inode, wii_lock held
+ * @r: where to put the range; r->dentry is NULL if there was none
+ */
+static void
+nvfs_coalesce_take(struct nvfs_inode_info *wi, struct nvfs_wrange *r)
+{
+	ENTER;
+
+	r->dentry = wi->wii_wdentry;
+	r->start = wi->wii_wstart;
+	r->end = wi->wii_wend;
+	if (r->dentry) {
+		wi->wii_wdentry = NULL;
+		spin_lock(&nvfs_coalesce_lock);
+		list_del_init(&wi->wii_wlist);
+		spin_unlock(&nvfs_coalesce_lock);
+	}
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_coalesce_emit - send a detached range as one write event
+ * @inode: upper inode it belongs to
+ * @r: range from nvfs_coalesce_take
+ */
+static void
+nvfs_coalesce_emit(struct inode *inode, struct nvfs_wrange *r)
+{
+	ENTER;
+
+	if (!r->dentry)
+		goto out;
+
+	NVFS_EVENT(write, r->dentry, INODE_TO_LOWER(inode),
+			DENTRY_TO_LOWER(r->dentry),
+			.flags = NVFS_EVF_COALESCED,
+			.offset = r->start, .count = r->end - r->start);
+	dput(r->dentry);
+out:
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_coalesce_wants - whether a write is left to the coalescer
+ * @count: length of the write
+ *
+ * If so, the caller sends no event of its own for the write and passes
+ * the lower write's result to nvfs_coalesce_write.
+ */
+int
+nvfs_coalesce_wants(size_t count)
+{
+	return nvfs_coalesce_ms && nvfs_hooks_active() && count;
+}
+
+/**
+ * nvfs_coalesce_write - merge a finished write into the pending range
+ * @inode: upper inode written
+ * @dentry: dentry of the file written
+ * @pos: offset the lower write started at
+ * @count: length asked for
+ * @res: what the lower write returned
+ * @flags: NVFS_EVF_* for the events of a write that failed
+ *
+ * A write that wrote nothing is not merged. It is sent, after the
+ * pending range, as a write event and a post event carrying @res.
+ */
+void
+nvfs_coalesce_write(struct inode *inode, struct dentry *dentry,
+		loff_t pos, size_t count, ssize_t res, unsigned int flags)
+{
+	loff_t			end = pos + res;
+	struct nvfs_wrange	old = { NULL };
+	struct nvfs_inode_info	*wi = INODE_TO_PRIVATE(inode);
+
+	ENTER;
+
+	if (res <= 0) {
+		nvfs_coalesce_flush(inode);
+		NVFS_EVENT(write, dentry, INODE_TO_LOWER(inode),
+				DENTRY_TO_LOWER(dentry), .flags = flags,
+				.offset = pos, .count = count);
+		NVFS_EVENT_POST(write, res, dentry, INODE_TO_LOWER(inode),
+				DENTRY_TO_LOWER(dentry), .flags = flags,
+				.offset = pos, .count = count);
+		goto out;
+	}
+
+	spin_lock(&wi->wii_lock);
+	if (wi->wii_wdentry && pos <= wi->wii_wend &&
+	    end >= wi->wii_wstart &&
+	    MAX(end, wi->wii_wend) - MIN(pos, wi->wii_wstart) <=
+			nvfs_coalesce_bytes &&
+	    time_before(jiffies, wi->wii_wtime + nvfs_coalesce_window())) {
+		wi->wii_wstart = MIN(pos, wi->wii_wstart);
+		wi->wii_wend = MAX(end, wi->wii_wend);
+		spin_unlock(&wi->wii_lock);
+		goto out;
+	}
+
+	nvfs_coalesce_take(wi, &old);
+	wi->wii_wdentry = dget(dentry);
+	wi->wii_wstart = pos;
+	wi->wii_wend = end;
+	wi->wii_wtime = jiffies;
+	spin_lock(&nvfs_coalesce_lock);
+	list_add_tail(&wi->wii_wlist, &nvfs_coalesce_list);
+	spin_unlock(&nvfs_coalesce_lock);
+	spin_unlock(&wi->wii_lock);
+
+	nvfs_coalesce_emit(inode, &old);
+	/* no-op while already scheduled */
+	schedule_delayed_work(&nvfs_coalesce_dwork, nvfs_coalesce_window());
+out:
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_coalesce_flush - send the pending range of an inode, if any
+ * @inode: upper inode
+ */
+void
+nvfs_coalesce_flush(struct inode *inode)
+{
+	struct nvfs_wrange	r;
+	struct nvfs_inode_info	*wi = INODE_TO_PRIVATE(inode);
+
+	ENTER;
+
+	/* unlocked peek; a range opened concurrently goes out later */
+	if (!ACCESS_ONCE(wi->wii_wdentry))
+		goto out;
+
+	spin_lock(&wi->wii_lock);
+	nvfs_coalesce_take(wi, &r);
+	spin_unlock(&wi->wii_lock);
+	nvfs_coalesce_emit(inode, &r);
+out:
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_coalesce_scan - flush pending ranges
+ * @sb: only flush inodes of this superblock, or NULL for all
+ * @expired: only flush ranges older than the window
+ *
+ * Inodes are pinned under the list lock and flushed after dropping it,
+ * since sending an event may sleep. The dentry held by a pending range
+ * keeps its inode live, so igrab should not fail here.
+ */
+static void
+nvfs_coalesce_scan(struct super_block *sb, int expired)
+{
+	int			i,
+				n;
+	unsigned long		window = nvfs_coalesce_window();
+	struct inode		*batch[NVFS_COALESCE_BATCH];
+	struct inode		*inode;
+	struct nvfs_inode_info	*wi;
+
+	ENTER;
+
+	do {
+		n = 0;
+		spin_lock(&nvfs_coalesce_lock);
+		list_for_each_entry(wi, &nvfs_coalesce_list, wii_wlist) {
+			if (expired &&
+			    time_before(jiffies, wi->wii_wtime + window))
+				break;
+			if (sb && wi->vfs_inode.i_sb != sb)
+				continue;
+			inode = igrab(&wi->vfs_inode);
+			if (!inode)
+				continue;
+			batch[n++] = inode;
+			if (n == NVFS_COALESCE_BATCH)
+				break;
+		}
+		spin_unlock(&nvfs_coalesce_lock);
+
+		for (i = 0; i < n; i++) {
+			nvfs_coalesce_flush(batch[i]);
+			iput(batch[i]);
+		}
+	} while (n == NVFS_COALESCE_BATCH);
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_coalesce_work - send ranges that have aged out
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void
+nvfs_coalesce_work(void *data)
+#else
+static void
+nvfs_coalesce_work(struct work_struct *work)
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20) */
+{
+	ENTER;
+
+	nvfs_coalesce_scan(NULL, 1);
+
+	spin_lock(&nvfs_coalesce_lock);
+	if (!list_empty(&nvfs_coalesce_list))
+		schedule_delayed_work(&nvfs_coalesce_dwork,
+				nvfs_coalesce_window());
+	spin_unlock(&nvfs_coalesce_lock);
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_coalesce_flush_sb - send every pending range of a superblock
+ * @sb: superblock being unmounted
+ */
+void
+nvfs_coalesce_flush_sb(struct super_block *sb)
+{
+	ENTER;
+	nvfs_coalesce_scan(sb, 0);
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_coalesce_exit - stop the aging timer
+ *
+ * Nothing can be pending once every superblock is gone.
+ */
+void
+nvfs_coalesce_exit(void)
+{
+	ENTER;
+	cancel_delayed_work(&nvfs_coalesce_dwork);
+	flush_scheduled_work();
+	EXIT_NORET;
+}
@@ -1,67 +1,219 @@
 #include "nvfs.h"
 
-#define D_CB(func, ...) do {						\
-	struct nvfs_callback_info	*cb;				\
-	struct list_head		*tmp,				\
-					*safe;				\
-	list_for_each_safe(tmp, safe, &nvfs_callbacks) {		\
-		cb = list_entry(tmp, struct nvfs_callback_info, next);	\
-		if (cb && cb->d_op && cb->d_op->func)			\
-			cb->d_op->func(__VA_ARGS__);			\
-	}								\
-} while (0)
+#define D_CB(dentry, func, ...) \
+	NVFS_CB((dentry)->d_sb, (struct dentry *)(dentry), d_op, func, \
+			__VA_ARGS__)
+#define D_HOOKED(dentry, func) NVFS_HOOKED((dentry)->d_sb, d_op, func)
+
+/*
+ * RCU-walk. From 2.6.38 the VFS first walks a path under rcu_read_lock,
+ * taking no references, and d_revalidate and permission return -ECHILD
+ * when they cannot answer without blocking; the VFS then walks it again
+ * the ordinary way. Callbacks may sleep, so an operation that somebody
+ * hooks on this mount gives up on RCU-walk. One that nobody hooks goes
+ * to the lower filesystem in the same mode, and it decides for itself.
+ *
+ * d_hash and d_compare are not told which walk they are in, and
+ * d_compare may be handed a dentry that d_release is tearing down. They
+ * find the lower dentry with nvfs_rcu_lower, and their callbacks must
+ * not sleep.
+ */
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
+#define NVFS_REVAL_RCU		0
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
+#define NVFS_REVAL_RCU		(nd && (nd->flags & LOOKUP_RCU))
+#else
+#define NVFS_REVAL_RCU		(flags & LOOKUP_RCU)
+#endif
+
+/* arguments of ->d_hash and ->d_compare, which changed over time */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+#define NVFS_HASH_ARGS(d, name)	(d), (d)->d_inode, (name)
+#define NVFS_COMPARE_ARGS(p, d, len, str, name) \
+	(p), (p)->d_inode, (d), (d)->d_inode, (len), (str), (name)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
+#define NVFS_HASH_ARGS(d, name)	(d), (name)
+#define NVFS_COMPARE_ARGS(p, d, len, str, name) \
+	(p), (d), (len), (str), (name)
+#else
+#define NVFS_HASH_ARGS(d, name)	(d), (name)
+#define NVFS_COMPARE_ARGS(p, d, len, str, name) \
+	(d), (len), (str), (name)
+#endif
+
+/**
+ * nvfs_rcu_lower - lower dentry of a dentry that may be going away
+ * @dentry: nvfs dentry
+ *
+ * d_release clears the private data before it frees it after a grace
+ * period, so under rcu_read_lock this returns the lower dentry or NULL.
+ */
+static inline struct dentry *
+nvfs_rcu_lower(const struct dentry *dentry)
+{
+	struct nvfs_dentry_info	*info = ACCESS_ONCE(dentry->d_fsdata);
+
+	return info ? ACCESS_ONCE(info->wdi_dentry) : NULL;
+}
+
+/**
+ * nvfs_ttl_fresh - whether a dentry was found valid recently enough
+ * @dentry: nvfs dentry
+ * @info: its private data
+ *
+ * The window is the mount's pos_ttl or neg_ttl, by whether the dentry
+ * is positive; with none set the lower filesystem is always asked.
+ */
+static inline int
+nvfs_ttl_fresh(struct dentry *dentry, struct nvfs_dentry_info *info)
+{
+	struct nvfs_sb_info	*sbi = SUPERBLOCK_TO_PRIVATE(dentry->d_sb);
+	unsigned int		ttl = dentry->d_inode ? sbi->wsi_pos_ttl :
+					sbi->wsi_neg_ttl;
 
+	return ttl && time_before(jiffies,
+			ACCESS_ONCE(info->wdi_time) + msecs_to_jiffies(ttl));
+}
+
+/**
+ * nvfs_d_revalidate - call underlying d_revalidate function
+ * @dentry: dentry to check
+ * @nd: lookup in progress (flags from 3.6 on)
+ *
+ * Within the mount's TTL of the last time it was found valid, a dentry
+ * is taken as valid without asking the lower filesystem, which for NFS
+ * saves a GETATTR per path component.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
 static int
 nvfs_d_revalidate(struct dentry *dentry, struct nameidata *nd)
+#else
+static int
+nvfs_d_revalidate(struct dentry *dentry, unsigned int flags)
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0) */
 {
-	int		err = 1;
-	struct dentry	*lower_dentry;
-	struct vfsmount	*lower_mount;
+	int			err = 1;
+	struct dentry		*lower_dentry;
+	struct nvfs_dentry_info	*info = ACCESS_ONCE(dentry->d_fsdata);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
+	struct vfsmount		*lower_mount;
 
 	NVFS_ND_DECLARATIONS;
+#endif
 
 	ENTER;
 
+	/* negative from the filter, see nvfs_bloom.c; never blocks */
+	if (!info && !dentry->d_inode) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
+		if (NVFS_FOR_CREATE(nd)) {
+#else
+		if (NVFS_FOR_CREATE(flags)) {
+#endif
+			/* look it up for real before it is created */
+			err = NVFS_REVAL_RCU ? -ECHILD : 0;
+			goto out;
+		}
+		err = nvfs_bloom_absent(ACCESS_ONCE(dentry->d_parent)->d_inode,
+				&dentry->d_name);
+		goto out;
+	}
+
+	if (NVFS_REVAL_RCU) {
+		err = -ECHILD;
+		if (!info || D_HOOKED(dentry, d_revalidate))
+			goto out;
+		lower_dentry = ACCESS_ONCE(info->wdi_dentry);
+		if (!dentry->d_inode && ACCESS_ONCE(lower_dentry->d_inode))
+			goto out;
+		err = 1;
+		if (!lower_dentry->d_op || !lower_dentry->d_op->d_revalidate ||
+		    nvfs_ttl_fresh(dentry, info))
+			goto out;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
+		/* only ref-walk may point nd at the lower path */
+		err = -ECHILD;
+#else
+		err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
+#endif
+		goto out_stamp;
+	}
+
 	lower_dentry = nvfs_lower_dentry(dentry);
 
-	D_CB(d_revalidate, lower_dentry, nd);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
+	D_CB(dentry, d_revalidate, lower_dentry, nd);
+#else
+	D_CB(dentry, d_revalidate, lower_dentry, flags);
+#endif
 
+	/* negative over a name found since, see nvfs_back_negative */
+	if (!dentry->d_inode && lower_dentry && lower_dentry->d_inode) {
+		err = 0;
+		goto out;
+	}
 	if (!lower_dentry || !lower_dentry->d_op ||
-	    !lower_dentry->d_op->d_revalidate)
+	    !lower_dentry->d_op->d_revalidate || nvfs_ttl_fresh(dentry, info))
 		goto out;
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,6,0)
 	lower_mount = DENTRY_TO_LVFSMNT(dentry);
 
 	NVFS_ND_SAVE_ARGS(dentry, lower_dentry, lower_mount);
 	err = lower_dentry->d_op->d_revalidate(lower_dentry, nd);
 	NVFS_ND_RESTORE_ARGS;
+#else
+	err = lower_dentry->d_op->d_revalidate(lower_dentry, flags);
+#endif
 
+out_stamp:
+	if (err > 0)
+		info->wdi_time = jiffies;
 out:
 	EXIT_RET(err);
 }
 
 
+/**
+ * nvfs_d_hash - call underlying d_hash function
+ * @dentry: directory the name is looked up in
+ * @name: name to hash
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
 static int
 nvfs_d_hash(struct dentry *dentry, struct qstr *name)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+static int
+nvfs_d_hash(const struct dentry *dentry, const struct inode *inode,
+		struct qstr *name)
+#else
+static int
+nvfs_d_hash(const struct dentry *dentry, struct qstr *name)
+#endif
 {
 	int		err = 0;
 	struct dentry	*lower_dentry;
 
 	ENTER;
-	lower_dentry = nvfs_lower_dentry(dentry);
+	lower_dentry = nvfs_rcu_lower(dentry);
+	if (!lower_dentry)
+		goto out;
 
-	D_CB(d_hash, lower_dentry, name);
+	D_CB(dentry, d_hash, NVFS_HASH_ARGS(lower_dentry, name));
 
-	if (!lower_dentry || !lower_dentry->d_op || !lower_dentry->d_op->d_hash)
+	if (!lower_dentry->d_op || !lower_dentry->d_op->d_hash)
 		goto out;
 
-	err = lower_dentry->d_op->d_hash(lower_dentry, name);
+	err = lower_dentry->d_op->d_hash(NVFS_HASH_ARGS(lower_dentry, name));
 
 out:
 	EXIT_RET(err);
 }
 
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
 static int
 nvfs_d_compare(struct dentry *dentry, struct qstr *a, struct qstr *b)
 {
@@ -72,7 +224,7 @@ nvfs_d_compare(struct dentry *dentry, struct qstr *a, struct qstr *b)
 
 	lower_dentry = nvfs_lower_dentry(dentry);
 
-	D_CB(d_compare, lower_dentry, a, b);
+	D_CB(dentry, d_compare, lower_dentry, a, b);
 
 	if (lower_dentry && lower_dentry->d_op &&
 			lower_dentry->d_op->d_compare)
@@ -82,6 +234,62 @@ nvfs_d_compare(struct dentry *dentry, struct qstr *a, struct qstr *b)
 
 	EXIT_RET(err);
 }
+#else
+/**
+ * nvfs_d_compare - call underlying d_compare function
+ * @parent: directory (taken from @dentry from 4.8 on)
+ * @dentry: dentry in the hash chain, which may be going away
+ * @len: length of its name
+ * @str: its name
+ * @name: name looked up
+ *
+ * A dentry d_release has got to compares by bytes; that can only make a
+ * lookup miss, and a miss is settled by ->lookup.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,11,0)
+static int
+nvfs_d_compare(const struct dentry *parent, const struct inode *pinode,
+		const struct dentry *dentry, const struct inode *inode,
+		unsigned int len, const char *str, const struct qstr *name)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,8,0)
+static int
+nvfs_d_compare(const struct dentry *parent, const struct dentry *dentry,
+		unsigned int len, const char *str, const struct qstr *name)
+#else
+static int
+nvfs_d_compare(const struct dentry *dentry, unsigned int len,
+		const char *str, const struct qstr *name)
+#endif
+{
+	int			err;
+	struct dentry		*lower_parent,
+				*lower_dentry;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,8,0)
+	const struct dentry	*parent = ACCESS_ONCE(dentry->d_parent);
+#endif
+
+	ENTER;
+
+	lower_parent = nvfs_rcu_lower(parent);
+	lower_dentry = nvfs_rcu_lower(dentry);
+	if (!lower_parent || !lower_dentry) {
+		err = len != name->len || memcmp(str, name->name, len);
+		goto out;
+	}
+
+	D_CB(dentry, d_compare, NVFS_COMPARE_ARGS(lower_parent, lower_dentry,
+				len, str, name));
+
+	if (lower_parent->d_op && lower_parent->d_op->d_compare)
+		err = lower_parent->d_op->d_compare(
+				NVFS_COMPARE_ARGS(lower_parent, lower_dentry,
+					len, str, name));
+	else
+		err = len != name->len || memcmp(str, name->name, len);
+out:
+	EXIT_RET(err);
+}
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38) */
 
 
 int
@@ -102,7 +310,7 @@ nvfs_d_delete(struct dentry *dentry)
 	if (!lower_dentry)
 		goto out;
 
-	D_CB(d_delete, lower_dentry);
+	D_CB(dentry, d_delete, lower_dentry);
 
 	if (lower_dentry && lower_dentry->d_op &&
 			lower_dentry->d_op->d_delete)
@@ -112,10 +320,22 @@ out:
 }
 
 
+/**
+ * nvfs_d_free_info - free a dentry's private data after a grace period
+ * @head: its wdi_rcu
+ */
+static void
+nvfs_d_free_info(struct rcu_head *head)
+{
+	kfree(container_of(head, struct nvfs_dentry_info, wdi_rcu));
+}
+
+
 void
 nvfs_d_release(struct dentry *dentry)
 {
-	struct dentry	*lower_dentry;
+	struct dentry		*lower_dentry;
+	struct nvfs_dentry_info	*info;
 
 	ENTER;
 
@@ -127,10 +347,12 @@ nvfs_d_release(struct dentry *dentry)
 
 	lower_dentry = DENTRY_TO_LOWER(dentry);
 
-	D_CB(d_release, lower_dentry);
+	D_CB(dentry, d_release, lower_dentry);
 
-	mntput(DENTRY_TO_LVFSMNT(dentry));
-	kfree(DENTRY_TO_PRIVATE(dentry));
+	info = DENTRY_TO_PRIVATE(dentry);
+	DENTRY_TO_PRIVATE_SM(dentry) = NULL;
+	mntput(info->wdi_mnt);
+	call_rcu(&info->wdi_rcu, nvfs_d_free_info);
 	if (lower_dentry)
 		dput(lower_dentry);
 out:
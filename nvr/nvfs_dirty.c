@@ -0,0 +1,347 @@
+#include "nvfs.h"
+#include <asm/uaccess.h>
+
+/*
+ * Dirty extents. Each upper inode keeps the byte ranges written since
+ * they were last fetched, as an rbtree of disjoint extents ordered by
+ * start; a range that overlaps or touches others is merged with them on
+ * the way in, so the tree only grows with the number of separate holes
+ * in the written data, not with the number of writes. A consumer that
+ * only needs to know what changed (an incremental sync, say) fetches and
+ * resets the lot with nvfs_dirty_fetch, or NVFS_IOC_DIRTY_FETCH from
+ * userspace, and its cost then scales with the volume of change.
+ *
+ * Extents live with the in-core inode. One that is evicted loses them,
+ * so a new in-core inode starts out NVFS_DIRTY_UNKNOWN: whatever happened
+ * to the file before it was looked up again is for the consumer to find
+ * out by other means, a full compare most likely.
+ */
+
+/* most extents kept per inode; past this, the closest two are merged */
+#define NVFS_DIRTY_MAX	512
+
+struct nvfs_dirty_extent {
+	struct rb_node	node;
+	loff_t		start;
+	loff_t		end;		/* exclusive */
+};
+
+#define NVFS_DIRTY_ENTRY(n) rb_entry(n, struct nvfs_dirty_extent, node)
+
+/**
+ * nvfs_dirty_first - first extent that overlaps or touches @start
+ * @wi: inode, wii_lock held
+ * @start: offset
+ *
+ * Extents are disjoint, so ordering them by start orders them by end as
+ * well; the one wanted is the leftmost that ends at or after @start.
+ */
+static struct nvfs_dirty_extent *
+nvfs_dirty_first(struct nvfs_inode_info *wi, loff_t start)
+{
+	struct rb_node			*n = wi->wii_dirty.rb_node;
+	struct nvfs_dirty_extent	*e,
+					*found = NULL;
+
+	while (n) {
+		e = NVFS_DIRTY_ENTRY(n);
+		if (e->end >= start) {
+			found = e;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	return found;
+}
+
+/**
+ * nvfs_dirty_erase - take an extent out of the tree and free it
+ * @wi: inode, wii_lock held
+ * @e: extent
+ */
+static void
+nvfs_dirty_erase(struct nvfs_inode_info *wi, struct nvfs_dirty_extent *e)
+{
+	rb_erase(&e->node, &wi->wii_dirty);
+	wi->wii_ndirty--;
+	kfree(e);
+}
+
+/**
+ * nvfs_dirty_add - record that a byte range of a file has changed
+ * @inode: upper inode
+ * @start: first byte
+ * @end: byte after the last
+ *
+ * Should memory run out the range cannot be kept, and the inode is
+ * marked NVFS_DIRTY_UNKNOWN instead.
+ */
+void
+nvfs_dirty_add(struct inode *inode, loff_t start, loff_t end)
+{
+	struct nvfs_inode_info		*wi = INODE_TO_PRIVATE(inode);
+	struct nvfs_dirty_extent	*new,
+					*e,
+					*prev;
+	struct rb_node			**p,
+					*parent = NULL;
+
+	ENTER;
+
+	if (start >= end)
+		goto out;
+
+	/* callers may hold lower filesystem locks */
+	new = kmalloc(sizeof(*new), GFP_NOFS);
+	spin_lock(&wi->wii_lock);
+	if (!new) {
+		wi->wii_dflags |= NVFS_DIRTY_UNKNOWN;
+		goto out_unlock;
+	}
+
+	/* absorb everything the range overlaps or touches */
+	e = nvfs_dirty_first(wi, start);
+	while (e && e->start <= end) {
+		start = MIN(start, e->start);
+		end = MAX(end, e->end);
+		prev = e;
+		e = rb_next(&e->node) ? NVFS_DIRTY_ENTRY(rb_next(&e->node)) :
+			NULL;
+		nvfs_dirty_erase(wi, prev);
+	}
+
+	/* still full: close the smaller gap, to the left or the right */
+	if (wi->wii_ndirty >= NVFS_DIRTY_MAX) {
+		if (e)
+			prev = rb_prev(&e->node) ?
+				NVFS_DIRTY_ENTRY(rb_prev(&e->node)) : NULL;
+		else
+			prev = NVFS_DIRTY_ENTRY(rb_last(&wi->wii_dirty));
+		if (!e || (prev && start - prev->end < e->start - end))
+			e = prev;
+		start = MIN(start, e->start);
+		end = MAX(end, e->end);
+		nvfs_dirty_erase(wi, e);
+	}
+
+	new->start = start;
+	new->end = end;
+	p = &wi->wii_dirty.rb_node;
+	while (*p) {
+		parent = *p;
+		if (start < NVFS_DIRTY_ENTRY(parent)->start)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+	rb_link_node(&new->node, parent, p);
+	rb_insert_color(&new->node, &wi->wii_dirty);
+	wi->wii_ndirty++;
+out_unlock:
+	spin_unlock(&wi->wii_lock);
+out:
+	EXIT_NORET;
+}
+EXPORT_SYMBOL(nvfs_dirty_add);
+
+/**
+ * nvfs_dirty_resize - record a change of size
+ * @inode: upper inode
+ * @from: size before
+ * @to: size after
+ *
+ * Growing a file adds the new tail, which reads as zeros, as a dirty
+ * extent. Shrinking it drops whatever was dirty past the new end, and
+ * remembers the lowest size the file was cut to for the next fetch.
+ */
+void
+nvfs_dirty_resize(struct inode *inode, loff_t from, loff_t to)
+{
+	struct nvfs_inode_info		*wi = INODE_TO_PRIVATE(inode);
+	struct nvfs_dirty_extent	*e,
+					*next;
+	struct rb_node			*n;
+
+	ENTER;
+
+	if (to > from) {
+		nvfs_dirty_add(inode, from, to);
+		goto out;
+	}
+	if (to == from)
+		goto out;
+
+	spin_lock(&wi->wii_lock);
+	if (!(wi->wii_dflags & NVFS_DIRTY_TRUNCATED) || to < wi->wii_dsize)
+		wi->wii_dsize = to;
+	wi->wii_dflags |= NVFS_DIRTY_TRUNCATED;
+
+	for (e = nvfs_dirty_first(wi, to + 1); e; e = next) {
+		n = rb_next(&e->node);
+		next = n ? NVFS_DIRTY_ENTRY(n) : NULL;
+		if (e->start < to)
+			e->end = to;
+		else
+			nvfs_dirty_erase(wi, e);
+	}
+	spin_unlock(&wi->wii_lock);
+out:
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_dirty_fallocate - record what a fallocate may have changed
+ * @inode: upper inode, sizes already copied up from the lower one
+ * @offset: start of the range
+ * @len: length of the range
+ * @from: size before
+ *
+ * Any mode may write zeros into the range, or extend the file with it,
+ * so the range is taken as dirty. A mode that moves the data after it
+ * (collapse, insert) also changes the size, and then everything up to
+ * the end of the file, old or new, is taken as dirty too.
+ */
+void
+nvfs_dirty_fallocate(struct inode *inode, loff_t offset, loff_t len,
+		loff_t from)
+{
+	loff_t		to = i_size_read(inode),
+			end = offset + len;
+
+	ENTER;
+
+	if (to != from)
+		end = MAX(end, MAX(from, to));
+	nvfs_dirty_add(inode, offset, end);
+	if (to < from)
+		nvfs_dirty_resize(inode, from, to);
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_dirty_fetch - take the dirty extents of a file
+ * @inode: upper inode
+ * @ext: where to put them, lowest first
+ * @count: in, room in @ext; out, how many were put there
+ * @size: set to the lowest size the file was cut to, if it was
+ *
+ * What is returned is removed from the inode in the same critical
+ * section, so a write is either returned by this call or kept for the
+ * next one, never both or neither. NVFS_DIRTY_UNKNOWN and
+ * NVFS_DIRTY_TRUNCATED are reset with the first batch.
+ *
+ * Returns NVFS_DIRTY_* flags, with NVFS_DIRTY_MORE set if extents were
+ * left behind for lack of room.
+ */
+unsigned int
+nvfs_dirty_fetch(struct inode *inode, struct nvfs_extent *ext,
+		unsigned int *count, loff_t *size)
+{
+	unsigned int			flags,
+					n = 0;
+	struct nvfs_inode_info		*wi = INODE_TO_PRIVATE(inode);
+	struct rb_node			*node;
+	struct nvfs_dirty_extent	*e;
+
+	ENTER;
+
+	spin_lock(&wi->wii_lock);
+	flags = wi->wii_dflags;
+	*size = wi->wii_dsize;
+	wi->wii_dflags = 0;
+
+	while (n < *count && (node = rb_first(&wi->wii_dirty))) {
+		e = NVFS_DIRTY_ENTRY(node);
+		ext[n].start = e->start;
+		ext[n].end = e->end;
+		n++;
+		nvfs_dirty_erase(wi, e);
+	}
+	if (!RB_EMPTY_ROOT(&wi->wii_dirty))
+		flags |= NVFS_DIRTY_MORE;
+	spin_unlock(&wi->wii_lock);
+
+	*count = n;
+
+	EXIT_RET(flags);
+}
+EXPORT_SYMBOL(nvfs_dirty_fetch);
+
+/**
+ * nvfs_dirty_ioctl - NVFS_IOC_DIRTY_FETCH
+ * @inode: upper inode of the file the ioctl was issued on
+ * @uarg: user's struct nvfs_dirty_fetch
+ *
+ * Fetching resets, which concerns every consumer of the file, so it is
+ * kept to the administrator.
+ */
+int
+nvfs_dirty_ioctl(struct inode *inode, void __user *uarg)
+{
+	int			err;
+	unsigned int		flags;
+	loff_t			size = 0;
+	struct nvfs_dirty_fetch	arg;
+	struct nvfs_extent	*ext = NULL;
+
+	ENTER;
+
+	err = -EPERM;
+	if (!capable(CAP_SYS_ADMIN))
+		goto out;
+	err = -EINVAL;
+	if (!S_ISREG(inode->i_mode))
+		goto out;
+	err = -EFAULT;
+	if (copy_from_user(&arg, uarg, sizeof(arg)))
+		goto out;
+
+	/* one call can always empty a tree */
+	arg.count = MIN(arg.count, NVFS_DIRTY_MAX);
+	if (arg.count) {
+		err = -ENOMEM;
+		ext = kmalloc(arg.count * sizeof(*ext), GFP_KERNEL);
+		if (!ext)
+			goto out;
+	}
+
+	flags = nvfs_dirty_fetch(inode, ext, &arg.count, &size);
+	arg.flags = flags;
+	arg.size = (flags & NVFS_DIRTY_TRUNCATED) ? size : 0;
+
+	/*
+	 * What was fetched is gone from the inode, so a fault here loses
+	 * it; say so the next time round rather than pretend it was clean.
+	 */
+	err = 0;
+	if (copy_to_user((void __user *)(unsigned long)arg.extents, ext,
+				arg.count * sizeof(*ext)) ||
+	    copy_to_user(uarg, &arg, sizeof(arg))) {
+		spin_lock(&INODE_TO_PRIVATE(inode)->wii_lock);
+		INODE_TO_PRIVATE(inode)->wii_dflags |= NVFS_DIRTY_UNKNOWN;
+		spin_unlock(&INODE_TO_PRIVATE(inode)->wii_lock);
+		err = -EFAULT;
+	}
+	kfree(ext);
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_dirty_free - drop the extents of an inode going away
+ * @inode: upper inode
+ */
+void
+nvfs_dirty_free(struct inode *inode)
+{
+	struct nvfs_inode_info	*wi = INODE_TO_PRIVATE(inode);
+	struct rb_node		*node;
+
+	ENTER;
+
+	while ((node = rb_first(&wi->wii_dirty)))
+		nvfs_dirty_erase(wi, NVFS_DIRTY_ENTRY(node));
+
+	EXIT_NORET;
+}
@@ -0,0 +1,357 @@
+#include "nvfs.h"
+#include <linux/workqueue.h>
+#include <linux/hash.h>
+#include <linux/log2.h>
+
+/*
+ * Event delivery. Events go to the userspace rings while /dev/nvfs is
+ * open, and to every consumer with an ->event function, or a ->post
+ * function for events raised once the operation is done. Consumers are
+ * called inline from the hook site unless they registered with
+ * NVFS_CB_ASYNC, in which case the event is copied and queued on a shard
+ * picked by hashing the inode it applies to. A shard is drained by one
+ * worker at a time, so events for an inode are seen in order, while
+ * events for other inodes go to other shards and are delivered in
+ * parallel. Shards run on an unbound workqueue, so whichever worker is
+ * idle picks up the next busy shard regardless of the CPU the event was
+ * captured on. Each mount counts its events still queued, so unmount
+ * waits for its own and not for those of busier mounts.
+ */
+
+struct nvfs_deferred_event {
+	struct list_head	next;
+	struct nvfs_event	ev;
+};
+
+struct nvfs_event_shard {
+	spinlock_t		lock;
+	struct list_head	events;
+	int			queued;
+	struct work_struct	work;
+} ____cacheline_aligned_in_smp;
+
+/* events delivered from one shard before letting other shards run */
+#define NVFS_EVENT_BATCH	64
+
+static struct workqueue_struct	*nvfs_event_wq;
+static struct kmem_cache	*nvfs_event_cachep;
+static struct nvfs_event_shard	*nvfs_event_shards;
+static unsigned int		nvfs_event_nr_shards;
+/* woken as a mount's last queued event is delivered */
+static DECLARE_WAIT_QUEUE_HEAD(nvfs_event_flush_wait);
+
+static inline struct nvfs_event_shard *
+nvfs_event_shard(const struct nvfs_event *ev)
+{
+	return &nvfs_event_shards[hash_ptr(ev->inode,
+			ilog2(nvfs_event_nr_shards))];
+}
+
+/**
+ * nvfs_event_put - drop the references held by a deferred event
+ * @de: event to free
+ *
+ * Once the mount's count reaches zero it may be torn down, so the wait
+ * queue woken is a global one.
+ */
+static void
+nvfs_event_put(struct nvfs_deferred_event *de)
+{
+	struct nvfs_sb_info	*sbi = SUPERBLOCK_TO_PRIVATE(de->ev.sb);
+
+	ENTER;
+	dput(de->ev.dentry2);
+	dput(de->ev.dentry);
+	if (de->ev.inode)
+		iput(de->ev.inode);
+	dput(de->ev.upper);
+	kmem_cache_free(nvfs_event_cachep, de);
+	if (atomic_dec_and_test(&sbi->wsi_ev_queued))
+		wake_up(&nvfs_event_flush_wait);
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_event_call - call each consumer on a list
+ * @cbp: NULL terminated list from the dispatch snapshot
+ * @ev: event
+ */
+static inline void
+nvfs_event_call(struct nvfs_callback_info **cbp, const struct nvfs_event *ev)
+{
+	int	post = ev->flags & NVFS_EVF_POST;
+	u64	t;
+
+	for (; *cbp; cbp++) {
+		if (!nvfs_wants((*cbp)->root, (*cbp)->filter, ev))
+			continue;
+		t = nvfs_stats_clock();
+		NVFS_EV_HANDLER(*cbp, post)(*cbp, ev);
+		nvfs_stats_account(*cbp, ev->op, t);
+	}
+}
+
+/**
+ * nvfs_event_wanted - whether any consumer on a list would see an event
+ * @cbp: NULL terminated list from the dispatch snapshot, or NULL
+ * @ev: event
+ *
+ * Filters are run here as well as at delivery, so an event every
+ * deferred consumer filters out is never copied. A filter may in rare
+ * cases decide differently the second time; size or owner may change.
+ */
+static inline int
+nvfs_event_wanted(struct nvfs_callback_info **cbp, const struct nvfs_event *ev)
+{
+	if (cbp)
+		for (; *cbp; cbp++)
+			if (nvfs_wants((*cbp)->root, (*cbp)->filter, ev))
+				return 1;
+	return 0;
+}
+
+/**
+ * nvfs_event_deliver - hand a deferred event to the NVFS_CB_ASYNC consumers
+ * @ev: event to deliver
+ *
+ * The consumer list is sampled now rather than when the event was
+ * queued, so a consumer that has unregistered is never called.
+ */
+static void
+nvfs_event_deliver(const struct nvfs_event *ev)
+{
+	int				idx;
+	struct nvfs_dispatch		*d;
+	struct nvfs_callback_info	**cbp;
+
+	ENTER;
+
+	idx = srcu_read_lock(&nvfs_cb_srcu);
+	d = srcu_dereference(SUPERBLOCK_TO_PRIVATE(ev->sb)->wsi_dispatch,
+			&nvfs_cb_srcu);
+	if (d) {
+		cbp = d->ev[NVFS_EV_LIST(ev->flags & NVFS_EVF_POST, 1)];
+		if (cbp)
+			nvfs_event_call(cbp, ev);
+	}
+	srcu_read_unlock(&nvfs_cb_srcu, idx);
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_event_work - drain a shard
+ * @work: the shard's work item
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void
+nvfs_event_work(void *data)
+{
+	struct nvfs_event_shard		*shard = data;
+#else
+static void
+nvfs_event_work(struct work_struct *work)
+{
+	struct nvfs_event_shard		*shard =
+		container_of(work, struct nvfs_event_shard, work);
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20) */
+	int				n = 0;
+	struct nvfs_deferred_event	*de;
+
+	ENTER;
+
+	spin_lock(&shard->lock);
+	while (!list_empty(&shard->events)) {
+		/* still marked queued, so nobody else can pick it up */
+		if (n++ == NVFS_EVENT_BATCH) {
+			queue_work(nvfs_event_wq, &shard->work);
+			goto out;
+		}
+		de = list_entry(shard->events.next,
+				struct nvfs_deferred_event, next);
+		list_del(&de->next);
+		spin_unlock(&shard->lock);
+
+		nvfs_event_deliver(&de->ev);
+		nvfs_event_put(de);
+
+		spin_lock(&shard->lock);
+	}
+	shard->queued = 0;
+out:
+	spin_unlock(&shard->lock);
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_event_defer - queue a copy of an event for the worker threads
+ * @ev: event to copy
+ *
+ * We may be called with lower filesystem locks held, so we allocate
+ * GFP_NOFS and drop the event rather than wait for memory.
+ */
+static void
+nvfs_event_defer(const struct nvfs_event *ev)
+{
+	struct nvfs_event_shard		*shard;
+	struct nvfs_deferred_event	*de;
+
+	ENTER;
+
+	de = kmem_cache_alloc(nvfs_event_cachep, GFP_NOFS);
+	if (!de) {
+		if (printk_ratelimit())
+			printk(KERN_WARNING "nvfs: dropped deferred event\n");
+		goto out;
+	}
+
+	de->ev = *ev;
+	de->ev.upper = dget(ev->upper);
+	de->ev.inode = ev->inode ? igrab(ev->inode) : NULL;
+	de->ev.dentry = dget(ev->dentry);
+	de->ev.dentry2 = dget(ev->dentry2);
+	atomic_inc(&SUPERBLOCK_TO_PRIVATE(ev->sb)->wsi_ev_queued);
+
+	shard = nvfs_event_shard(ev);
+	spin_lock(&shard->lock);
+	list_add_tail(&de->next, &shard->events);
+	if (!shard->queued) {
+		shard->queued = 1;
+		queue_work(nvfs_event_wq, &shard->work);
+	}
+	spin_unlock(&shard->lock);
+out:
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_event_notify - hand an event to every ->event or ->post consumer
+ * @ev: event, normally on the caller's stack
+ *
+ * A write range still pending on the inode the event came through goes
+ * out first, unless this is that range or the post event of an
+ * operation whose event already sent it.
+ */
+void
+nvfs_event_notify(struct nvfs_event *ev)
+{
+	int				idx,
+					post = ev->flags & NVFS_EVF_POST;
+	struct nvfs_dispatch		*d;
+	struct nvfs_callback_info	**cbp;
+
+	ENTER;
+
+	if (!(ev->flags & (NVFS_EVF_POST | NVFS_EVF_COALESCED)) &&
+	    ev->upper->d_inode)
+		nvfs_coalesce_flush(ev->upper->d_inode);
+
+	idx = srcu_read_lock(&nvfs_cb_srcu);
+	d = srcu_dereference(SUPERBLOCK_TO_PRIVATE(ev->sb)->wsi_dispatch,
+			&nvfs_cb_srcu);
+	if (d) {
+		cbp = d->ev[NVFS_EV_LIST(post, 0)];
+		if (cbp)
+			nvfs_event_call(cbp, ev);
+		if (nvfs_event_wanted(d->ev[NVFS_EV_LIST(post, 1)], ev))
+			nvfs_event_defer(ev);
+	}
+	if (nvfs_rings)
+		nvfs_ring_write(ev);
+	srcu_read_unlock(&nvfs_cb_srcu, idx);
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_event_flush - wait until a mount's queued events are delivered
+ * @sb: nvfs superblock
+ *
+ * Called at unmount, once nothing can raise new events on @sb.
+ */
+void
+nvfs_event_flush(struct super_block *sb)
+{
+	struct nvfs_sb_info	*sbi = SUPERBLOCK_TO_PRIVATE(sb);
+
+	ENTER;
+	wait_event(nvfs_event_flush_wait, !atomic_read(&sbi->wsi_ev_queued));
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_event_init - set up deferred delivery
+ */
+int
+nvfs_event_init(void)
+{
+	int		err = 0;
+	unsigned int	i;
+
+	ENTER;
+
+	/* a few shards per CPU keeps unrelated inodes from queueing up */
+	nvfs_event_nr_shards = roundup_pow_of_two(MAX(4 * num_possible_cpus(),
+				2));
+	nvfs_event_shards = kcalloc(nvfs_event_nr_shards,
+			sizeof(struct nvfs_event_shard), GFP_KERNEL);
+	if (!nvfs_event_shards) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nvfs_event_nr_shards; i++) {
+		spin_lock_init(&nvfs_event_shards[i].lock);
+		INIT_LIST_HEAD(&nvfs_event_shards[i].events);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+		INIT_WORK(&nvfs_event_shards[i].work, nvfs_event_work,
+				&nvfs_event_shards[i]);
+#else
+		INIT_WORK(&nvfs_event_shards[i].work, nvfs_event_work);
+#endif
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+	nvfs_event_cachep = kmem_cache_create("nvfs_event_cache",
+			sizeof(struct nvfs_deferred_event), 0, 0, NULL, NULL);
+#else
+	nvfs_event_cachep = kmem_cache_create("nvfs_event_cache",
+			sizeof(struct nvfs_deferred_event), 0, 0, NULL);
+#endif
+	if (!nvfs_event_cachep) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
+	nvfs_event_wq = create_workqueue("nvfs_events");
+#else
+	nvfs_event_wq = alloc_workqueue("nvfs_events", WQ_UNBOUND, 0);
+#endif
+	if (!nvfs_event_wq) {
+		err = -ENOMEM;
+		goto out_cache;
+	}
+	goto out;
+
+out_cache:
+	kmem_cache_destroy(nvfs_event_cachep);
+out_free:
+	kfree(nvfs_event_shards);
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_event_exit - tear down deferred delivery
+ */
+void
+nvfs_event_exit(void)
+{
+	ENTER;
+	/* every mount is gone and has flushed its events */
+	destroy_workqueue(nvfs_event_wq);
+	kmem_cache_destroy(nvfs_event_cachep);
+	kfree(nvfs_event_shards);
+	EXIT_NORET;
+}
@@ -5,16 +5,25 @@
 /*
  * Callback loop for file functions
  */
-#define F_CB(op, func, ...) do {					\
-	struct nvfs_callback_info       *cb;				\
-	struct list_head		*tmp,				\
-					*safe;				\
-	list_for_each_safe(tmp, safe, &nvfs_callbacks) {		\
-		cb = list_entry(tmp, struct nvfs_callback_info, next);	\
-		if (cb && cb->op && cb->op->func)			\
-			cb->op->func(__VA_ARGS__);			\
-	}								\
-} while (0)
+#define F_CB(dentry, op, func, ...) \
+	NVFS_CB((dentry)->d_sb, dentry, op, func, __VA_ARGS__)
+#define F_CB_RANGE(dentry, off, cnt, op, func, ...) \
+	NVFS_CB_RANGE((dentry)->d_sb, dentry, off, cnt, op, func, __VA_ARGS__)
+
+/*
+ * whether the lower file can take O_DIRECT; the 6.0 test has never been
+ * compiled, see the end of the README
+ */
+static inline int
+nvfs_lower_can_direct(struct file *lower_file)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,0,0)
+	return lower_file->f_mode & FMODE_CAN_ODIRECT;
+#else
+	return lower_file->f_mapping->a_ops &&
+		lower_file->f_mapping->a_ops->direct_IO;
+#endif
+}
 
 
 /**
@@ -22,6 +31,9 @@
  * @file: file struct in which to seek
  * @offset: where we're seeking to
  * @origin: what the starting point for the seek is
+ *
+ * SEEK_DATA and SEEK_HOLE go down like any other origin, so it is the
+ * lower filesystem that finds the holes.
  */
 static loff_t
 nvfs_llseek(struct file *file, loff_t offset, int origin)
@@ -31,13 +43,14 @@ nvfs_llseek(struct file *file, loff_t offset, int origin)
 
 	ENTER;
 
+	err = nvfs_wcombine_flush(file);
+	if (err)
+		goto out;
+
 	lower_file = FILE_TO_LOWER(file);
 	lower_file->f_pos = file->f_pos;
 
-	memcpy(&(lower_file->f_ra), &(file->f_ra),
-			sizeof(struct file_ra_state));
-
-	F_CB(reg_f_op, llseek, lower_file, offset, origin);
+	F_CB(file->f_dentry, reg_f_op, llseek, lower_file, offset, origin);
 
 	if (lower_file->f_op && lower_file->f_op->llseek)
 		err = lower_file->f_op->llseek(lower_file, offset, origin);
@@ -52,9 +65,57 @@ nvfs_llseek(struct file *file, loff_t offset, int origin)
 		file->f_version++;
 	}
 out:
-	EXIT_RET((int) err);
+	EXIT_RET(err);
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+
+#define NVFS_F_DIRECT(file) \
+	(((file)->f_flags & O_DIRECT) ? NVFS_EVF_DIRECT : 0)
+
+/* what F_SETFL holds while it changes f_flags */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,30)
+#define nvfs_flags_lock(file)	lock_kernel()
+#define nvfs_flags_unlock(file)	unlock_kernel()
+#else
+#define nvfs_flags_lock(file)	spin_lock(&(file)->f_lock)
+#define nvfs_flags_unlock(file)	spin_unlock(&(file)->f_lock)
+#endif
+
+/**
+ * nvfs_sync_direct - follow an O_DIRECT change made with fcntl
+ * @file: nvfs file
+ * @lower_file: the file it reads and writes through
+ *
+ * The lower file was opened with our flags, but F_SETFL only changes
+ * ours. Our direct_IO lets the VFS set O_DIRECT on any regular file,
+ * so fail I/O the lower file could not do directly rather than have it
+ * try. Both files' flags are read and changed under the lock F_SETFL
+ * takes, so a concurrent fcntl on either is not lost.
+ */
+static int
+nvfs_sync_direct(struct file *file, struct file *lower_file)
+{
+	int		err = 0;
+	unsigned int	direct;
+
+	ENTER;
+
+	nvfs_flags_lock(file);
+	direct = file->f_flags & O_DIRECT;
+	nvfs_flags_unlock(file);
+
+	nvfs_flags_lock(lower_file);
+	if ((lower_file->f_flags & O_DIRECT) != direct) {
+		if (direct && !nvfs_lower_can_direct(lower_file))
+			err = -EINVAL;
+		else
+			lower_file->f_flags ^= O_DIRECT;
+	}
+	nvfs_flags_unlock(lower_file);
+
+	EXIT_RET(err);
+}
 
 /**
  * nvfs_read - call the underlying read function
@@ -77,7 +138,17 @@ nvfs_read(struct file *file, char *buf, size_t count, loff_t *ppos)
 	if (!lower_file->f_op || !lower_file->f_op->read)
 		goto out;
 
-	F_CB(reg_f_op, read, lower_file, buf, count, ppos);
+	err = nvfs_sync_direct(file, lower_file);
+	if (!err)
+		err = nvfs_wcombine_flush(file);
+	if (err)
+		goto out;
+
+	F_CB_RANGE(file->f_dentry, pos, count, reg_f_op, read,
+			lower_file, buf, count, ppos);
+	NVFS_EVENT(read, file->f_dentry, lower_file->f_dentry->d_inode,
+			lower_file->f_dentry, .offset = pos, .count = count,
+			.flags = NVFS_F_DIRECT(file));
 
 	err = lower_file->f_op->read(lower_file, buf, count, &pos);
 
@@ -90,9 +161,6 @@ nvfs_read(struct file *file, char *buf, size_t count, loff_t *ppos)
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0) */
 		lower_file->f_pos = *ppos = pos;
 
-	memcpy(&(file->f_ra), &(lower_file->f_ra),
-			sizeof(struct file_ra_state));
-
 out:
 	EXIT_RET(err);
 }
@@ -110,8 +178,11 @@ out:
 static ssize_t
 nvfs_write(struct file *file, const char *buf, size_t count, loff_t *ppos)
 {
-	int		err = -EINVAL;
-	loff_t		pos = *ppos;
+	int		err = -EINVAL,
+			coalesced,
+			direct;
+	loff_t		pos = *ppos,
+			start;
 	struct file	*lower_file = NULL;
 	struct inode	*inode,
 			*lower_inode;
@@ -127,15 +198,43 @@ nvfs_write(struct file *file, const char *buf, size_t count, loff_t *ppos)
 	if ((file->f_flags & O_APPEND) && (count != 0))
 		pos = i_size_read(inode);
 
-	F_CB(reg_f_op, write, lower_file, buf, count, &pos);
-
 	if (!lower_file->f_op || !lower_file->f_op->write)
 		goto out;
+	err = nvfs_sync_direct(file, lower_file);
+	if (err)
+		goto out;
+
+	F_CB_RANGE(file->f_dentry, pos, count, reg_f_op, write,
+			lower_file, buf, count, &pos);
+	direct = NVFS_F_DIRECT(file);
+	err = nvfs_wcombine_write(file, buf, count, &pos,
+			file->f_flags & O_APPEND, direct);
+	if (err) {
+		/* absorbed, or what was buffered could not be written */
+		if (err > 0)
+			lower_file->f_pos = *ppos = pos;
+		goto out;
+	}
+	start = pos;
+	/* direct writes are not merged, so they stay flagged as such */
+	coalesced = !direct && nvfs_coalesce_wants(count);
+	if (!coalesced)
+		NVFS_EVENT(write, file->f_dentry, lower_inode,
+				lower_file->f_dentry,
+				.offset = pos, .count = count, .flags = direct);
 
 	if (count != 0)
 		err = lower_file->f_op->write(lower_file, buf, count, &pos);
 	else
 		err = 0;
+	if (coalesced)
+		nvfs_coalesce_write(inode, file->f_dentry,
+				err > 0 ? pos - err : start, count, err, 0);
+	else
+		NVFS_EVENT_POST(write, err, file->f_dentry,
+				lower_inode, lower_file->f_dentry,
+				.offset = start, .count = count,
+				.flags = direct);
 
 	/*
 	 * copy ctime and mtime from lower layer attributes
@@ -143,6 +242,9 @@ nvfs_write(struct file *file, const char *buf, size_t count, loff_t *ppos)
 	 */
 	if (err >= 0)
 		nvfs_copy_attr_times(inode, lower_inode);
+	/* pos is past what was written, appending or not */
+	if (err > 0)
+		nvfs_dirty_add(inode, pos - err, pos);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,0)
 	if (ppos == &file->f_pos)
@@ -156,6 +258,355 @@ out:
 	EXIT_RET(err);
 }
 
+#else
+
+/*
+ * Iterator I/O. A vectored or async request is passed down whole: one
+ * lower call, one callback and one event however many segments it has.
+ * An async request is reissued on the lower file with a kiocb of our
+ * own, and is completed to the submitter from the lower completion, so
+ * no thread waits on it in between.
+ *
+ * This is written for 4.1 and later, which the rest of this file does
+ * not build on yet (.ioctl, .readdir, f_dentry); it has never been
+ * compiled. Up to 2.6.34 the read and write above are used.
+ */
+
+#define NVFS_IOCB_DIRECT(iocb) \
+	(((iocb)->ki_flags & IOCB_DIRECT) ? NVFS_EVF_DIRECT : 0)
+
+/* a write that may not wait in a write combining buffer */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0)
+#define NVFS_IOCB_PASS(iocb) ((iocb)->ki_flags & (IOCB_DIRECT | IOCB_DSYNC))
+#else
+#define NVFS_IOCB_PASS(iocb) ((iocb)->ki_flags & IOCB_DIRECT)
+#endif
+
+/* an async request in flight on the lower file */
+struct nvfs_aio_req {
+	struct kiocb		iocb;		/* lower request */
+	struct kiocb		*orig;		/* as submitted to us */
+	loff_t			start;
+	size_t			count;
+	int			write;
+	int			coalesced;
+	long			res;
+	struct work_struct	work;
+};
+
+/**
+ * nvfs_iter_done - bring the upper inode up to date after iterator I/O
+ * @iocb: request as submitted to us
+ * @start: offset it started at
+ * @count: bytes asked for
+ * @res: result of the lower request
+ * @write: whether it was a write
+ * @coalesced: the write is left to the coalescer, no post event
+ */
+static void
+nvfs_iter_done(struct kiocb *iocb, loff_t start, size_t count, long res,
+		int write, int coalesced)
+{
+	struct file	*file = iocb->ki_filp,
+			*lower_file = FILE_TO_LOWER(file);
+	struct inode	*inode = file->f_dentry->d_inode,
+			*lower_inode = INODE_TO_LOWER(inode);
+
+	ENTER;
+
+	if (!write) {
+		if (res >= 0)
+			nvfs_copy_attr_atime(inode, lower_inode);
+		goto out;
+	}
+
+	/* an append started wherever the lower file's end was */
+	if (res > 0 && (iocb->ki_flags & IOCB_APPEND))
+		start = iocb->ki_pos - res;
+	if (coalesced)
+		nvfs_coalesce_write(inode, file->f_dentry, start, count, res,
+				0);
+	else
+		NVFS_EVENT_POST(write, res, file->f_dentry, lower_inode,
+				lower_file->f_dentry,
+				.offset = start, .count = count,
+				.flags = NVFS_IOCB_DIRECT(iocb));
+	if (res >= 0)
+		nvfs_copy_attr_timesizes(inode, lower_inode);
+	if (res > 0)
+		nvfs_dirty_add(inode, start, start + res);
+out:
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_aio_end_write - drop the freeze protection of an async write
+ * @req: request, written or failed
+ *
+ * It was taken in the submitting thread and handed over, as aio does.
+ */
+static inline void
+nvfs_aio_end_write(struct nvfs_aio_req *req)
+{
+	struct file	*lower_file = req->iocb.ki_filp;
+
+	if (!req->write)
+		return;
+	__sb_writers_acquired(file_inode(lower_file)->i_sb, SB_FREEZE_WRITE);
+	file_end_write(lower_file);
+}
+
+/**
+ * nvfs_aio_work - finish an async request in process context
+ * @work: the request's work item
+ */
+static void
+nvfs_aio_work(struct work_struct *work)
+{
+	struct nvfs_aio_req	*req =
+		container_of(work, struct nvfs_aio_req, work);
+	struct kiocb		*orig = req->orig;
+
+	ENTER;
+
+	nvfs_aio_end_write(req);
+	orig->ki_pos = req->iocb.ki_pos;
+	nvfs_iter_done(orig, req->start, req->count, req->res, req->write,
+			req->coalesced);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
+	orig->ki_complete(orig, req->res, 0);
+#else
+	orig->ki_complete(orig, req->res);
+#endif
+	kfree(req);
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_aio_complete - completion of a lower async request
+ * @iocb: our lower kiocb
+ * @res: its result
+ *
+ * This may run in interrupt context, while post consumers and the
+ * attribute copy may sleep, so the rest is left to a worker.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0)
+static void
+nvfs_aio_complete(struct kiocb *iocb, long res, long res2)
+#else
+static void
+nvfs_aio_complete(struct kiocb *iocb, long res)
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(5,16,0) */
+{
+	struct nvfs_aio_req	*req =
+		container_of(iocb, struct nvfs_aio_req, iocb);
+
+	ENTER;
+
+	req->res = res;
+	INIT_WORK(&req->work, nvfs_aio_work);
+	schedule_work(&req->work);
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_iter_check - whether the lower file can take a request
+ * @iocb: request as submitted to us
+ * @write: whether it is a write
+ *
+ * IOCB_DIRECT is passed down with the request, and the VFS lets anyone
+ * set O_DIRECT on us, so refuse it here if the lower file cannot do it.
+ */
+static int
+nvfs_iter_check(struct kiocb *iocb, int write)
+{
+	int		err = -EINVAL;
+	struct file	*lower_file = FILE_TO_LOWER(iocb->ki_filp);
+
+	ENTER;
+
+	if (!lower_file->f_op ||
+	    !(write ? lower_file->f_op->write_iter :
+			lower_file->f_op->read_iter))
+		goto out;
+	if ((iocb->ki_flags & IOCB_DIRECT) &&
+	    !nvfs_lower_can_direct(lower_file))
+		goto out;
+	err = 0;
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_iter_io - pass iterator I/O to the lower file
+ * @iocb: request as submitted to us
+ * @iter: data
+ * @write: whether it is a write
+ * @coalesced: see nvfs_iter_done
+ *
+ * The request has passed nvfs_iter_check. A synchronous request gets
+ * a synchronous lower kiocb on the stack. An async one gets a lower
+ * kiocb of its own with @iocb's position, flags and priority; if the
+ * lower file does not queue it, it is finished here as a synchronous
+ * one would be. Writes hold freeze protection on the lower filesystem
+ * until they are done.
+ */
+static ssize_t
+nvfs_iter_io(struct kiocb *iocb, struct iov_iter *iter, int write,
+		int coalesced)
+{
+	ssize_t			err;
+	size_t			count = iov_iter_count(iter);
+	loff_t			start = iocb->ki_pos;
+	struct file		*lower_file = FILE_TO_LOWER(iocb->ki_filp);
+	struct kiocb		lower_iocb;
+	struct nvfs_aio_req	*req;
+
+	ENTER;
+
+	if (is_sync_kiocb(iocb)) {
+		init_sync_kiocb(&lower_iocb, lower_file);
+		lower_iocb.ki_pos = iocb->ki_pos;
+		lower_iocb.ki_flags = iocb->ki_flags;
+		if (write) {
+			file_start_write(lower_file);
+			err = lower_file->f_op->write_iter(&lower_iocb, iter);
+			file_end_write(lower_file);
+		} else
+			err = lower_file->f_op->read_iter(&lower_iocb, iter);
+		iocb->ki_pos = lower_iocb.ki_pos;
+		nvfs_iter_done(iocb, start, count, err, write, coalesced);
+		goto out;
+	}
+
+	req = kmalloc(sizeof(*req), GFP_KERNEL);
+	if (!req) {
+		err = -ENOMEM;
+		nvfs_iter_done(iocb, start, count, err, write, coalesced);
+		goto out;
+	}
+	init_sync_kiocb(&req->iocb, lower_file);
+	req->iocb.ki_pos = iocb->ki_pos;
+	req->iocb.ki_flags = iocb->ki_flags;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,18,0)
+	req->iocb.ki_ioprio = iocb->ki_ioprio;
+#endif
+	req->iocb.ki_complete = nvfs_aio_complete;
+	req->orig = iocb;
+	req->start = start;
+	req->count = count;
+	req->write = write;
+	req->coalesced = coalesced;
+
+	if (write) {
+		file_start_write(lower_file);
+		/* lockdep: the completion may run in another thread */
+		__sb_writers_release(file_inode(lower_file)->i_sb,
+				SB_FREEZE_WRITE);
+		err = lower_file->f_op->write_iter(&req->iocb, iter);
+	} else
+		err = lower_file->f_op->read_iter(&req->iocb, iter);
+	if (err == -EIOCBQUEUED)
+		goto out;
+
+	nvfs_aio_end_write(req);
+	iocb->ki_pos = req->iocb.ki_pos;
+	nvfs_iter_done(iocb, start, count, err, write, coalesced);
+	kfree(req);
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_read_iter - call the underlying read_iter function
+ * @iocb: request
+ * @iter: where to read into
+ *
+ * Callbacks get a copy of @iter, which they share.
+ */
+static ssize_t
+nvfs_read_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+	ssize_t		err;
+	size_t		count = iov_iter_count(iter);
+	struct iov_iter	cb_iter = *iter;
+	struct file	*file = iocb->ki_filp,
+			*lower_file = FILE_TO_LOWER(file);
+
+	ENTER;
+
+	err = nvfs_iter_check(iocb, 0);
+	if (!err)
+		err = nvfs_wcombine_flush(file);
+	if (err)
+		goto out;
+
+	F_CB_RANGE(file->f_dentry, iocb->ki_pos, count, reg_f_op, read_iter,
+			iocb, &cb_iter);
+	NVFS_EVENT(read, file->f_dentry, lower_file->f_dentry->d_inode,
+			lower_file->f_dentry,
+			.offset = iocb->ki_pos, .count = count,
+			.flags = NVFS_IOCB_DIRECT(iocb));
+
+	err = nvfs_iter_io(iocb, iter, 0, 0);
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_write_iter - call the underlying write_iter function
+ * @iocb: request
+ * @iter: what to write
+ *
+ * Callbacks get a copy of @iter, which they share.
+ */
+static ssize_t
+nvfs_write_iter(struct kiocb *iocb, struct iov_iter *iter)
+{
+	int		coalesced;
+	ssize_t		err;
+	size_t		count = iov_iter_count(iter);
+	loff_t		pos = iocb->ki_pos;
+	struct iov_iter	cb_iter = *iter;
+	struct file	*file = iocb->ki_filp,
+			*lower_file = FILE_TO_LOWER(file);
+	struct inode	*inode = file->f_dentry->d_inode;
+
+	ENTER;
+
+	err = nvfs_iter_check(iocb, 1);
+	if (err)
+		goto out;
+
+	/* the lower file appends at its own size; this is our best guess */
+	if ((iocb->ki_flags & IOCB_APPEND) && count != 0)
+		pos = i_size_read(inode);
+
+	F_CB_RANGE(file->f_dentry, pos, count, reg_f_op, write_iter,
+			iocb, &cb_iter);
+	err = nvfs_wcombine_write(file, iter, count, &iocb->ki_pos,
+			iocb->ki_flags & IOCB_APPEND,
+			!is_sync_kiocb(iocb) || NVFS_IOCB_PASS(iocb));
+	if (err)
+		goto out;
+	/* direct writes are not merged, so they stay flagged as such */
+	coalesced = !(iocb->ki_flags & IOCB_DIRECT) &&
+		nvfs_coalesce_wants(count);
+	if (!coalesced)
+		NVFS_EVENT(write, file->f_dentry, INODE_TO_LOWER(inode),
+				lower_file->f_dentry,
+				.offset = pos, .count = count,
+				.flags = NVFS_IOCB_DIRECT(iocb));
+
+	err = nvfs_iter_io(iocb, iter, 1, coalesced);
+out:
+	EXIT_RET(err);
+}
+
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0) */
+
 
 /**
  * nvfs_readdir - call underlying readdir function via vfs_readdir
@@ -176,7 +627,7 @@ nvfs_readdir(struct file *file, void *dirent, filldir_t filldir)
 	inode = file->f_dentry->d_inode;
 	lower_file->f_pos = file->f_pos;
 
-	F_CB(reg_f_op, readdir, lower_file, dirent, filldir);
+	F_CB(file->f_dentry, reg_f_op, readdir, lower_file, dirent, filldir);
 
 	err = vfs_readdir(lower_file, filldir, dirent);
 
@@ -202,7 +653,7 @@ nvfs_poll(struct file *file, poll_table *wait)
 
 	lower_file = FILE_TO_LOWER(file);
 
-	F_CB(reg_f_op, poll, lower_file, wait);
+	F_CB(file->f_dentry, reg_f_op, poll, lower_file, wait);
 
 	if (!lower_file->f_op || !lower_file->f_op->poll)
 		goto out;
@@ -230,11 +681,20 @@ nvfs_ioctl(struct inode *inode, struct file *file, unsigned int cmd,
 	ENTER;
 
 	switch (cmd) {
+	case NVFS_IOC_DIRTY_FETCH:
+		err = nvfs_dirty_ioctl(inode, (void __user *)arg);
+		break;
+	case NVFS_IOC_WCOMBINE:
+		err = get_user(val, (__u32 __user *)arg);
+		if (!err)
+			err = nvfs_wcombine_set(file, val);
+		break;
 	default:
 		lower_file = FILE_TO_LOWER(file);
 		if (lower_file && lower_file->f_op && lower_file->f_op->ioctl) {
-			F_CB(reg_f_op, ioctl, INODE_TO_LOWER(inode),
-					lower_file, cmd, arg);
+			F_CB(file->f_dentry, reg_f_op, ioctl,
+					INODE_TO_LOWER(inode), lower_file,
+					cmd, arg);
 			err = lower_file->f_op->ioctl(INODE_TO_LOWER(inode),
 					lower_file, cmd, arg);
 		} else
@@ -244,6 +704,387 @@ nvfs_ioctl(struct inode *inode, struct file *file, unsigned int cmd,
 	EXIT_RET(err);
 }
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+/**
+ * nvfs_fallocate - call the underlying fallocate function
+ * @file: file to allocate in
+ * @mode: FALLOC_FL_* flags
+ * @offset: start of the range
+ * @len: length of the range
+ *
+ * Never compiled; see the end of the README.
+ */
+static long
+nvfs_fallocate(struct file *file, int mode, loff_t offset, loff_t len)
+{
+	long		err = -EOPNOTSUPP;
+	loff_t		size;
+	struct file	*lower_file = FILE_TO_LOWER(file);
+	struct inode	*inode = file->f_dentry->d_inode,
+			*lower_inode = INODE_TO_LOWER(inode);
+
+	ENTER;
+
+	if (!lower_file->f_op || !lower_file->f_op->fallocate)
+		goto out;
+	err = nvfs_wcombine_flush(file);
+	if (err)
+		goto out;
+
+	F_CB_RANGE(file->f_dentry, offset, len, reg_f_op, fallocate,
+			lower_file, mode, offset, len);
+	NVFS_EVENT(fallocate, file->f_dentry, lower_inode,
+			lower_file->f_dentry,
+			.offset = offset, .count = len, .mode = mode);
+
+	size = i_size_read(inode);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
+	/* the VFS only froze out writes to our superblock */
+	sb_start_write(lower_inode->i_sb);
+#endif
+	err = lower_file->f_op->fallocate(lower_file, mode, offset, len);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,6,0)
+	sb_end_write(lower_inode->i_sb);
+#endif
+	NVFS_EVENT_POST(fallocate, err, file->f_dentry, lower_inode,
+			lower_file->f_dentry,
+			.offset = offset, .count = len, .mode = mode);
+	if (err)
+		goto out;
+
+	nvfs_copy_attr_timesizes(inode, lower_inode);
+	nvfs_dirty_fallocate(inode, offset, len, size);
+out:
+	EXIT_RET(err);
+}
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38) */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+/**
+ * nvfs_fadvise - pass an access pattern hint to the lower file
+ * @file: file the hint is for
+ * @offset: start of the range
+ * @len: length of the range, 0 for the rest of the file
+ * @advice: POSIX_FADV_*
+ *
+ * All reads go through the lower file, and so does its readahead state,
+ * so hints such as POSIX_FADV_SEQUENTIAL must be set on it. readahead(2)
+ * comes here too. Never compiled; see the end of the README.
+ */
+static int
+nvfs_fadvise(struct file *file, loff_t offset, loff_t len, int advice)
+{
+	int		err;
+	struct file	*lower_file = FILE_TO_LOWER(file);
+
+	ENTER;
+
+	F_CB_RANGE(file->f_dentry, offset, len, reg_f_op, fadvise,
+			lower_file, offset, len, advice);
+	err = vfs_fadvise(lower_file, offset, len, advice);
+
+	EXIT_RET(err);
+}
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0) */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+/**
+ * nvfs_copy_file_range - copy a range between two files in the kernel
+ * @file_in: source
+ * @pos_in: offset in the source
+ * @file_out: destination, an nvfs file
+ * @pos_out: offset in the destination
+ * @len: bytes to copy
+ * @flags: COPY_FILE_* flags
+ *
+ * The copy is done by the lower filesystem, by reflink or server side
+ * copy if it can, and is seen by consumers as one event on the
+ * destination, with the source as the second dentry. Never compiled;
+ * see the end of the README.
+ */
+static ssize_t
+nvfs_copy_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, size_t len,
+		unsigned int flags)
+{
+	ssize_t		err = -EXDEV;
+	struct file	*lower_in,
+			*lower_out;
+	struct inode	*inode = file_out->f_dentry->d_inode,
+			*lower_inode = INODE_TO_LOWER(inode);
+
+	ENTER;
+
+	/* without a lower file for the source, let the VFS copy by hand */
+	if (file_in->f_op != &nvfs_main_fops)
+		goto out;
+	lower_in = FILE_TO_LOWER(file_in);
+	lower_out = FILE_TO_LOWER(file_out);
+	err = nvfs_wcombine_flush(file_in);
+	if (!err)
+		err = nvfs_wcombine_flush(file_out);
+	if (err)
+		goto out;
+
+	F_CB_RANGE(file_out->f_dentry, pos_out, len, reg_f_op,
+			copy_file_range, lower_in, pos_in, lower_out, pos_out,
+			len, flags);
+	NVFS_EVENT(copy_file_range, file_out->f_dentry, lower_inode,
+			lower_out->f_dentry, .dentry2 = lower_in->f_dentry,
+			.offset = pos_out, .offset2 = pos_in, .count = len);
+
+	err = vfs_copy_file_range(lower_in, pos_in, lower_out, pos_out, len,
+			flags);
+	NVFS_EVENT_POST(copy_file_range, err, file_out->f_dentry, lower_inode,
+			lower_out->f_dentry, .dentry2 = lower_in->f_dentry,
+			.offset = pos_out, .offset2 = pos_in, .count = len);
+	if (err < 0)
+		goto out;
+
+	nvfs_copy_attr_timesizes(inode, lower_inode);
+	nvfs_copy_attr_atime(file_in->f_dentry->d_inode,
+			lower_in->f_dentry->d_inode);
+	nvfs_dirty_add(inode, pos_out, pos_out + err);
+out:
+	EXIT_RET(err);
+}
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0) */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+/**
+ * nvfs_remap_file_range - clone or dedupe a range between two files
+ * @file_in: source, an nvfs file on the same mount
+ * @pos_in: offset in the source
+ * @file_out: destination
+ * @pos_out: offset in the destination
+ * @len: bytes to remap, 0 for up to the end of the source
+ * @remap_flags: REMAP_FILE_* flags
+ *
+ * The VFS only calls this for two files on the same mount, so both are
+ * ours. The event's mode is @remap_flags, which tells a clone from a
+ * dedupe; only a clone changes what the destination reads as. Never
+ * compiled; see the end of the README.
+ */
+static loff_t
+nvfs_remap_file_range(struct file *file_in, loff_t pos_in,
+		struct file *file_out, loff_t pos_out, loff_t len,
+		unsigned int remap_flags)
+{
+	loff_t		err;
+	struct file	*lower_in = FILE_TO_LOWER(file_in),
+			*lower_out = FILE_TO_LOWER(file_out);
+	struct inode	*inode = file_out->f_dentry->d_inode,
+			*lower_inode = INODE_TO_LOWER(inode);
+
+	ENTER;
+
+	err = nvfs_wcombine_flush(file_in);
+	if (!err)
+		err = nvfs_wcombine_flush(file_out);
+	if (err)
+		goto out;
+
+	F_CB_RANGE(file_out->f_dentry, pos_out, len, reg_f_op,
+			remap_file_range, lower_in, pos_in, lower_out, pos_out,
+			len, remap_flags);
+	NVFS_EVENT(remap_file_range, file_out->f_dentry, lower_inode,
+			lower_out->f_dentry, .dentry2 = lower_in->f_dentry,
+			.offset = pos_out, .offset2 = pos_in, .count = len,
+			.mode = remap_flags);
+
+	if (remap_flags & REMAP_FILE_DEDUP)
+		err = vfs_dedupe_file_range_one(lower_in, pos_in, lower_out,
+				pos_out, len, remap_flags);
+	else
+		err = vfs_clone_file_range(lower_in, pos_in, lower_out,
+				pos_out, len, remap_flags);
+	NVFS_EVENT_POST(remap_file_range, err, file_out->f_dentry,
+			lower_inode, lower_out->f_dentry,
+			.dentry2 = lower_in->f_dentry,
+			.offset = pos_out, .offset2 = pos_in, .count = len,
+			.mode = remap_flags);
+	if (err < 0)
+		goto out;
+
+	nvfs_copy_attr_timesizes(inode, lower_inode);
+	if (!(remap_flags & REMAP_FILE_DEDUP))
+		nvfs_dirty_add(inode, pos_out, pos_out + err);
+out:
+	EXIT_RET(err);
+}
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0) */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+
+/*
+ * Shared writable mappings. The vma belongs to the lower file, so stores
+ * through it never pass through nvfs; to see them we stack our own
+ * vm_operations over the lower ones and raise a page_mkwrite event when
+ * a clean page is first written. The kernel write protects a page again
+ * when it is cleaned for writeback, so that is once per page per
+ * writeback cycle, and stores to a page already made writable cost
+ * nothing. A page that is already dirty when another mapping faults on
+ * it was seen this cycle, by a write or an earlier fault, and raises
+ * nothing; the page's own dirty bit is the per page bitmap.
+ */
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
+typedef vm_fault_t nvfs_fault_t;
+#else
+typedef int nvfs_fault_t;
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
+#define NVFS_VMF_ARGS	struct vm_fault *vmf
+#define NVFS_VMF_VMA	(vmf->vma)
+#define NVFS_VMF_PASS	vmf
+#else
+#define NVFS_VMF_ARGS	struct vm_area_struct *vma, struct vm_fault *vmf
+#define NVFS_VMF_VMA	vma
+#define NVFS_VMF_PASS	vma, vmf
+#endif
+
+/* kept in vm_private_data, shared by the vmas split or copied from one */
+struct nvfs_vma_info {
+	atomic_t				count;
+	const struct vm_operations_struct	*lower_ops;
+	struct path				path;	/* nvfs file */
+};
+
+static void
+nvfs_vma_put(struct nvfs_vma_info *vi)
+{
+	ENTER;
+
+	if (atomic_dec_and_test(&vi->count)) {
+		path_put(&vi->path);
+		kfree(vi);
+	}
+
+	EXIT_NORET;
+}
+
+static void
+nvfs_vm_open(struct vm_area_struct *vma)
+{
+	struct nvfs_vma_info	*vi = vma->vm_private_data;
+
+	ENTER;
+
+	atomic_inc(&vi->count);
+	if (vi->lower_ops->open)
+		vi->lower_ops->open(vma);
+
+	EXIT_NORET;
+}
+
+static void
+nvfs_vm_close(struct vm_area_struct *vma)
+{
+	struct nvfs_vma_info	*vi = vma->vm_private_data;
+
+	ENTER;
+
+	if (vi->lower_ops->close)
+		vi->lower_ops->close(vma);
+	nvfs_vma_put(vi);
+
+	EXIT_NORET;
+}
+
+static nvfs_fault_t
+nvfs_vm_fault(NVFS_VMF_ARGS)
+{
+	nvfs_fault_t		ret = VM_FAULT_SIGBUS;
+	struct nvfs_vma_info	*vi = NVFS_VMF_VMA->vm_private_data;
+
+	ENTER;
+
+	if (vi->lower_ops->fault)
+		ret = vi->lower_ops->fault(NVFS_VMF_PASS);
+
+	EXIT_RET(ret);
+}
+
+/**
+ * nvfs_vm_page_mkwrite - a clean page is about to be written through a
+ * shared mapping
+ */
+static nvfs_fault_t
+nvfs_vm_page_mkwrite(NVFS_VMF_ARGS)
+{
+	nvfs_fault_t		ret;
+	struct vm_area_struct	*v = NVFS_VMF_VMA;
+	struct nvfs_vma_info	*vi = v->vm_private_data;
+	struct page		*page = vmf->page;
+
+	ENTER;
+
+	if (!PageDirty(page))
+		NVFS_EVENT(page_mkwrite, vi->path.dentry,
+				v->vm_file->f_dentry->d_inode,
+				v->vm_file->f_dentry,
+				.offset = page_offset(page),
+				.count = PAGE_SIZE);
+	ret = vi->lower_ops->page_mkwrite(NVFS_VMF_PASS);
+	/* even a dirty page may have been fetched since it was dirtied */
+	if (!(ret & VM_FAULT_ERROR))
+		nvfs_dirty_add(vi->path.dentry->d_inode, page_offset(page),
+				page_offset(page) + PAGE_SIZE);
+
+	EXIT_RET(ret);
+}
+
+struct vm_operations_struct nvfs_shared_vmops = {
+	.open		= nvfs_vm_open,
+	.close		= nvfs_vm_close,
+	.fault		= nvfs_vm_fault,
+	.page_mkwrite	= nvfs_vm_page_mkwrite,
+};
+
+/**
+ * nvfs_mmap_track - stack nvfs_shared_vmops over a lower mapping
+ * @file: nvfs file being mapped
+ * @vma: vma the lower file has just set up
+ *
+ * Only writable shared mappings are stacked, and only when the lower
+ * vm_operations can be wrapped without losing anything: they must have
+ * a page_mkwrite, and must not use vm_private_data, which is ours. Any
+ * other mapping is left exactly as the lower file made it. Optional
+ * operations beyond those in nvfs_shared_vmops are not forwarded, so
+ * the kernel uses its defaults for them (no fault-around, for one).
+ */
+static void
+nvfs_mmap_track(struct file *file, struct vm_area_struct *vma)
+{
+	struct nvfs_vma_info	*vi;
+
+	ENTER;
+
+	if ((vma->vm_flags & (VM_SHARED | VM_MAYWRITE)) !=
+			(VM_SHARED | VM_MAYWRITE))
+		goto out;
+	if (!vma->vm_ops || !vma->vm_ops->page_mkwrite ||
+	    vma->vm_private_data)
+		goto out;
+
+	vi = kmalloc(sizeof(*vi), GFP_KERNEL);
+	if (!vi)
+		goto out;
+	atomic_set(&vi->count, 1);
+	vi->lower_ops = vma->vm_ops;
+	/* pins the nvfs mount too, as the lower file pins the lower one */
+	vi->path = file->f_path;
+	path_get(&vi->path);
+
+	vma->vm_private_data = vi;
+	vma->vm_ops = &nvfs_shared_vmops;
+out:
+	EXIT_NORET;
+}
+
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30) */
+
 /**
  * nvfs_mmap - call the underlying mmap fuction
  * @file: file to map
@@ -264,11 +1105,23 @@ nvfs_mmap(struct file *file, struct vm_area_struct *vma)
 		err = -ENODEV;
 		goto out;
 	}
+	err = nvfs_wcombine_flush(file);
+	if (err)
+		goto out;
 
-	F_CB(reg_f_op, mmap, lower_file, vma);
+	F_CB(file->f_dentry, reg_f_op, mmap, lower_file, vma);
+	NVFS_EVENT(mmap, file->f_dentry, lower_file->f_dentry->d_inode,
+			lower_file->f_dentry,
+			.offset = (loff_t)vma->vm_pgoff << PAGE_SHIFT,
+			.count = vma->vm_end - vma->vm_start,
+			.mode = vma->vm_flags & VM_SHARED);
 
 	vma->vm_file = lower_file;
 	err = lower_file->f_op->mmap(lower_file, vma);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,30)
+	if (!err)
+		nvfs_mmap_track(file, vma);
+#endif
 	get_file(lower_file);
 	fput(file);
 
@@ -296,6 +1149,7 @@ nvfs_open(struct inode *inode, struct file *file)
 		err = -ENOMEM;
 		goto out;
 	}
+	FILE_TO_PRIVATE(file)->wfi_wcombine = NULL;
 
 	lower_dentry = nvfs_lower_dentry(file->f_dentry);
 
@@ -316,7 +1170,10 @@ nvfs_open(struct inode *inode, struct file *file)
 		goto out;
 	}
 
-	F_CB(reg_f_op, open, INODE_TO_LOWER(inode), lower_file);
+	F_CB(file->f_dentry, reg_f_op, open, INODE_TO_LOWER(inode),
+			lower_file);
+	NVFS_EVENT(open, file->f_dentry, INODE_TO_LOWER(inode), lower_dentry,
+			.mode = lower_flags);
 
 	FILE_TO_LOWER(file) = lower_file;
 
@@ -338,27 +1195,32 @@ nvfs_flush(struct file *file)
 nvfs_flush(struct file *file, fl_owner_t id)
 #endif
 {
-	int		err = 0;
+	int		err = 0,
+			lower_err;
 	struct file	*lower_file = NULL;
 
 	ENTER;
 
 	lower_file = FILE_TO_LOWER(file);
+	/* close(2) is the last chance to report a failed write out */
+	err = nvfs_wcombine_flush(file);
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16)
-	F_CB(reg_f_op, flush, lower_file);
+	F_CB(file->f_dentry, reg_f_op, flush, lower_file);
 #else
-	F_CB(reg_f_op, flush, lower_file, id);
+	F_CB(file->f_dentry, reg_f_op, flush, lower_file, id);
 #endif
 
 	if (!lower_file->f_op || !lower_file->f_op->flush)
 		goto out;
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16)
-	err = lower_file->f_op->flush(lower_file);
+	lower_err = lower_file->f_op->flush(lower_file);
 #else
-	err = lower_file->f_op->flush(lower_file, id);
+	lower_err = lower_file->f_op->flush(lower_file, id);
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18) */
+	if (!err)
+		err = lower_err;
 
 out:
 	EXIT_RET(err);
@@ -381,11 +1243,13 @@ nvfs_release(struct inode *inode, struct file *file)
 	ENTER;
 
 	lower_file = FILE_TO_LOWER(file);
+	nvfs_wcombine_release(file);
 	kfree(FILE_TO_PRIVATE(file));
 
 	lower_inode = INODE_TO_LOWER(inode);
 
-	F_CB(reg_f_op, release, lower_inode, lower_file);
+	F_CB(file->f_dentry, reg_f_op, release, lower_inode, lower_file);
+	NVFS_EVENT(release, file->f_dentry, lower_inode, lower_file->f_dentry);
 
 	lower_dentry = lower_file->f_dentry;
 	fput(lower_file);
@@ -403,7 +1267,8 @@ nvfs_release(struct inode *inode, struct file *file)
 static int
 nvfs_fsync(struct file *file, struct dentry *dentry, int datasync)
 {
-	int		err = -EINVAL;
+	int		err = -EINVAL,
+			wc_err = 0;
 	struct file	*lower_file = NULL;
 	struct dentry	*lower_dentry;
 
@@ -420,9 +1285,15 @@ nvfs_fsync(struct file *file, struct dentry *dentry, int datasync)
 		if (lower_dentry->d_inode->i_fop &&
 				lower_dentry->d_inode->i_fop->fsync) {
 			lock_inode(lower_dentry->d_inode);
-			F_CB(reg_f_op, fsync, NULL, lower_dentry, datasync);
+			F_CB(dentry, reg_f_op, fsync, NULL, lower_dentry,
+					datasync);
+			NVFS_EVENT(fsync, dentry, lower_dentry->d_inode,
+					lower_dentry, .mode = datasync);
 			err = lower_dentry->d_inode->i_fop->fsync(lower_file,
 					lower_dentry, datasync);
+			NVFS_EVENT_POST(fsync, err, dentry,
+					lower_dentry->d_inode,
+					lower_dentry, .mode = datasync);
 			unlock_inode(lower_dentry->d_inode);
 		}
 	} else {
@@ -431,15 +1302,29 @@ nvfs_fsync(struct file *file, struct dentry *dentry, int datasync)
 			BUG_ON(!lower_file);
 
 			lower_dentry = nvfs_lower_dentry(dentry);
+			/* buffered writes are part of what is synced */
+			wc_err = nvfs_wcombine_flush(file);
 
-			F_CB(reg_f_op, fsync, lower_file,
+			F_CB(dentry, reg_f_op, fsync, lower_file,
 					lower_dentry, datasync);
-			if (lower_file->f_op && lower_file->f_op->fsync) {
+			NVFS_EVENT(fsync, dentry, lower_dentry->d_inode,
+					lower_dentry, .mode = datasync);
+			if (!lower_file->f_op || !lower_file->f_op->fsync)
+				err = -EINVAL;
+			else if (nvfs_gcommit_wanted(dentry->d_sb))
+				err = nvfs_gcommit_fsync(dentry->d_sb,
+						lower_file);
+			else {
 				lock_inode(lower_dentry->d_inode);
 				err = lower_file->f_op->fsync(lower_file,
 						lower_dentry, datasync);
 				unlock_inode(lower_dentry->d_inode);
 			}
+			NVFS_EVENT_POST(fsync, err, dentry,
+					lower_dentry->d_inode,
+					lower_dentry, .mode = datasync);
+			if (wc_err)
+				err = wc_err;
 		}
 	}
 
@@ -461,7 +1346,7 @@ nvfs_fasync(int fd, struct file *file, int flag)
 	ENTER;
 	lower_file = FILE_TO_LOWER(file);
 
-	F_CB(reg_f_op, fasync, fd, lower_file, flag);
+	F_CB(file->f_dentry, reg_f_op, fasync, fd, lower_file, flag);
 
 	if (lower_file->f_op && lower_file->f_op->fasync)
 		err = lower_file->f_op->fasync(fd, lower_file, flag);
@@ -487,7 +1372,8 @@ nvfs_sendfile(struct file *file, loff_t *ppos,
 	if (FILE_TO_PRIVATE(file) != NULL)
 		lower_file = FILE_TO_LOWER(file);
 
-	F_CB(reg_f_op, sendfile, lower_file, ppos, count, actor, target);
+	F_CB(file->f_dentry, reg_f_op, sendfile, lower_file, ppos, count,
+			actor, target);
 
 	if (lower_file->f_op && lower_file->f_op->sendfile)
 		err = lower_file->f_op->sendfile(lower_file, ppos, count,
@@ -498,13 +1384,239 @@ nvfs_sendfile(struct file *file, loff_t *ppos,
 
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17)
+
+/**
+ * nvfs_splice_read - splice from the underlying file
+ * @file: file we're reading from
+ * @ppos: file position pointer
+ * @pipe: pipe to fill
+ * @count: how many bytes to move
+ * @flags: SPLICE_F_* flags
+ *
+ * The lower file hands its own page cache pages to @pipe, so sendfile
+ * and splice from nvfs stay zero copy. Consumers see the whole range as
+ * one read.
+ */
+static ssize_t
+nvfs_splice_read(struct file *file, loff_t *ppos,
+		struct pipe_inode_info *pipe, size_t count, unsigned int flags)
+{
+	ssize_t		err = -EINVAL;
+	loff_t		pos = *ppos;
+	struct file	*lower_file = NULL;
+
+	ENTER;
+
+	lower_file = FILE_TO_LOWER(file);
+
+	if (!lower_file->f_op || !lower_file->f_op->splice_read)
+		goto out;
+	err = nvfs_wcombine_flush(file);
+	if (err)
+		goto out;
+
+	F_CB_RANGE(file->f_dentry, pos, count, reg_f_op, splice_read,
+			lower_file, ppos, pipe, count, flags);
+	NVFS_EVENT(read, file->f_dentry, lower_file->f_dentry->d_inode,
+			lower_file->f_dentry, .offset = pos, .count = count);
+
+	err = lower_file->f_op->splice_read(lower_file, &pos, pipe, count,
+			flags);
+
+	if (err >= 0)
+		nvfs_copy_attr_atime(file->f_dentry->d_inode,
+				lower_file->f_dentry->d_inode);
+	*ppos = pos;
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_splice_write - splice into the underlying file
+ * @pipe: pipe to drain
+ * @file: file we're writing to
+ * @ppos: file position pointer
+ * @count: how many bytes to move
+ * @flags: SPLICE_F_* flags
+ *
+ * Seen by consumers as a write of the whole range, coalesced as one.
+ */
+static ssize_t
+nvfs_splice_write(struct pipe_inode_info *pipe, struct file *file,
+		loff_t *ppos, size_t count, unsigned int flags)
+{
+	int		coalesced;
+	ssize_t		err = -EINVAL;
+	loff_t		pos = *ppos,
+			start = *ppos;
+	struct file	*lower_file = NULL;
+	struct inode	*inode,
+			*lower_inode;
+
+	ENTER;
+
+	lower_file = FILE_TO_LOWER(file);
+
+	inode = file->f_dentry->d_inode;
+	lower_inode = INODE_TO_LOWER(inode);
+
+	if (!lower_file->f_op || !lower_file->f_op->splice_write)
+		goto out;
+	err = nvfs_wcombine_flush(file);
+	if (err)
+		goto out;
+
+	F_CB_RANGE(file->f_dentry, pos, count, reg_f_op, splice_write,
+			pipe, lower_file, ppos, count, flags);
+	coalesced = nvfs_coalesce_wants(count);
+	if (!coalesced)
+		NVFS_EVENT(write, file->f_dentry, lower_inode,
+				lower_file->f_dentry,
+				.offset = pos, .count = count);
+
+	err = lower_file->f_op->splice_write(pipe, lower_file, &pos, count,
+			flags);
+	if (coalesced)
+		nvfs_coalesce_write(inode, file->f_dentry, start, count, err,
+				0);
+	else
+		NVFS_EVENT_POST(write, err, file->f_dentry,
+				lower_inode, lower_file->f_dentry,
+				.offset = start, .count = count);
+
+	if (err >= 0)
+		nvfs_copy_attr_times(inode, lower_inode);
+	if (err > 0)
+		nvfs_dirty_add(inode, pos - err, pos);
+	*ppos = pos;
+
+	if (pos > i_size_read(inode))
+		i_size_write(inode, pos);
+out:
+	EXIT_RET(err);
+}
+
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17) */
+
+/**
+ * nvfs_direct_IO - hand direct I/O on a regular file to the lower file
+ *
+ * Our reads and writes go to the lower file without passing through our
+ * pages, so only something working on our mapping gets here; that this
+ * exists is also what lets open(2) and F_SETFL take O_DIRECT on us. The
+ * request is reissued on the lower file, with O_DIRECT carried down
+ * first, and waited for there; the lower file does it directly or fails
+ * it.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,16,0)
+static ssize_t
+nvfs_direct_IO(int rw, struct kiocb *iocb, const struct iovec *iov,
+		loff_t offset, unsigned long nr_segs)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+static ssize_t
+nvfs_direct_IO(int rw, struct kiocb *iocb, struct iov_iter *iter,
+		loff_t offset)
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(4,7,0)
+static ssize_t
+nvfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter, loff_t offset)
+#else
+static ssize_t
+nvfs_direct_IO(struct kiocb *iocb, struct iov_iter *iter)
+#endif
+{
+	ssize_t		err = -EINVAL;
+	struct file	*lower_file = FILE_TO_LOWER(iocb->ki_filp);
+	struct kiocb	lower_iocb;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,19)
+	ssize_t		done;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,1,0)
+	int		rw = iov_iter_rw(iter);
+#endif
+
+	ENTER;
+
+	if (!lower_file->f_op)
+		goto out;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+	err = nvfs_sync_direct(iocb->ki_filp, lower_file);
+	if (err)
+		goto out;
+	err = -EINVAL;
+#else
+	if (!nvfs_lower_can_direct(lower_file))
+		goto out;
+#endif
+
+	init_sync_kiocb(&lower_iocb, lower_file);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,19)
+	/* aio_read and aio_write took a single buffer */
+	for (done = 0; nr_segs; iov++, nr_segs--) {
+		lower_iocb.ki_pos = offset + done;
+		if (rw & WRITE)
+			err = lower_file->f_op->aio_write ?
+				lower_file->f_op->aio_write(&lower_iocb,
+					iov->iov_base, iov->iov_len,
+					offset + done) : -EINVAL;
+		else
+			err = lower_file->f_op->aio_read ?
+				lower_file->f_op->aio_read(&lower_iocb,
+					iov->iov_base, iov->iov_len,
+					offset + done) : -EINVAL;
+		if (err == -EIOCBQUEUED)
+			err = wait_on_sync_kiocb(&lower_iocb);
+		if (err <= 0)
+			break;
+		done += err;
+		if (err < iov->iov_len)
+			break;
+	}
+	if (done)
+		err = done;
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(3,16,0)
+	lower_iocb.ki_pos = offset;
+	if (rw & WRITE) {
+		if (lower_file->f_op->aio_write)
+			err = lower_file->f_op->aio_write(&lower_iocb, iov,
+					nr_segs, offset);
+	} else if (lower_file->f_op->aio_read)
+		err = lower_file->f_op->aio_read(&lower_iocb, iov, nr_segs,
+				offset);
+	if (err == -EIOCBQUEUED)
+		err = wait_on_sync_kiocb(&lower_iocb);
+#else
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+	lower_iocb.ki_pos = offset;
+#else
+	lower_iocb.ki_pos = iocb->ki_pos;
+	lower_iocb.ki_flags = iocb->ki_flags | IOCB_DIRECT;
+#endif
+	if (rw & WRITE) {
+		if (lower_file->f_op->write_iter)
+			err = lower_file->f_op->write_iter(&lower_iocb, iter);
+	} else if (lower_file->f_op->read_iter)
+		err = lower_file->f_op->read_iter(&lower_iocb, iter);
+#endif
+out:
+	EXIT_RET(err);
+}
+
+struct address_space_operations nvfs_aops = {
+	.direct_IO	= nvfs_direct_IO,
+};
+
 struct file_operations nvfs_dir_fops = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
 	.read		= nvfs_read,
+	.write		= nvfs_write,
+#else
+	.read_iter	= nvfs_read_iter,
+	.write_iter	= nvfs_write_iter,
+#endif
 	.poll		= nvfs_poll,
 	.mmap		= nvfs_mmap,
 	.open		= nvfs_open,
 	.ioctl		= nvfs_ioctl,
-	.write		= nvfs_write,
 	.flush		= nvfs_flush,
 	.fsync		= nvfs_fsync,
 	.llseek		= nvfs_llseek,
@@ -514,20 +1626,39 @@ struct file_operations nvfs_dir_fops = {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 	.sendfile	= nvfs_sendfile,
 #endif
-	/* not needed: readv */
-	/* not needed: writev */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17)
+	.splice_read	= nvfs_splice_read,
+	.splice_write	= nvfs_splice_write,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+	.fallocate	= nvfs_fallocate,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+	.fadvise	= nvfs_fadvise,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+	.copy_file_range = nvfs_copy_file_range,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	.remap_file_range = nvfs_remap_file_range,
+#endif
 	/* not implemented: sendpage */
 	/* not implemented: get_unmapped_area */
 };
 
 struct file_operations nvfs_main_fops = {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
 	.read		= nvfs_read,
+	.write		= nvfs_write,
+#else
+	.read_iter	= nvfs_read_iter,
+	.write_iter	= nvfs_write_iter,
+#endif
 	.poll		= nvfs_poll,
 	.mmap		= nvfs_mmap,
 	.open		= nvfs_open,
 	.fsync		= nvfs_fsync,
 	.flush		= nvfs_flush,
-	.write		= nvfs_write,
 	.ioctl		= nvfs_ioctl,
 	.fasync		= nvfs_fasync,
 	.llseek		= nvfs_llseek,
@@ -536,8 +1667,22 @@ struct file_operations nvfs_main_fops = {
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
 	.sendfile	= nvfs_sendfile,
 #endif
-	/* not needed: readv */
-	/* not needed: writev */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17)
+	.splice_read	= nvfs_splice_read,
+	.splice_write	= nvfs_splice_write,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+	.fallocate	= nvfs_fallocate,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+	.fadvise	= nvfs_fadvise,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+	.copy_file_range = nvfs_copy_file_range,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+	.remap_file_range = nvfs_remap_file_range,
+#endif
 	/* not implemented: sendpage */
 	/* not implemented: get_unmapped_area */
 };
@@ -0,0 +1,213 @@
+#include "nvfs.h"
+
+/*
+ * Filter programs, see struct nvfs_filter. Programs are checked once at
+ * registration so that running one needs no bounds checks at all; it is
+ * done at every hook site a filtered consumer is on, before the consumer
+ * is called or an event is copied for it.
+ */
+
+/**
+ * nvfs_filter_check - verify a program before it is attached
+ * @f: program, or NULL
+ *
+ * Returns 0 if @f may be run, else -EINVAL.
+ */
+int
+nvfs_filter_check(const struct nvfs_filter *f)
+{
+	int				err = 0;
+	unsigned int			i;
+	const struct nvfs_filter_insn	*insn;
+
+	ENTER;
+
+	if (!f)
+		goto out;
+
+	err = -EINVAL;
+	if (!f->insns || !f->len || f->len > NVFS_FILTER_MAX_INSNS)
+		goto out;
+	/* only jumps and returns leave an instruction other than forward */
+	if (f->insns[f->len - 1].code != NVFS_FLT_RET)
+		goto out;
+
+	for (i = 0; i < f->len; i++) {
+		insn = &f->insns[i];
+		switch (insn->code) {
+		case NVFS_FLT_LD:
+			if (insn->k >= NVFS_FLD_MAX)
+				goto out;
+			break;
+		case NVFS_FLT_JSUFFIX:
+		case NVFS_FLT_JPREFIX:
+			if (!insn->str || strlen(insn->str) > NAME_MAX)
+				goto out;
+			/* fall through */
+		case NVFS_FLT_JEQ:
+		case NVFS_FLT_JGT:
+		case NVFS_FLT_JGE:
+		case NVFS_FLT_JSET:
+			if (i + 1 + insn->jt >= f->len ||
+			    i + 1 + insn->jf >= f->len)
+				goto out;
+			break;
+		case NVFS_FLT_RET:
+			break;
+		default:
+			goto out;
+		}
+	}
+	err = 0;
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_filter_name - match the start or end of a dentry's name
+ * @dentry: nvfs dentry, or NULL
+ * @str: string to look for
+ * @suffix: match the end rather than the start
+ *
+ * The name is read without d_lock, which hook sites such as d_delete
+ * may already hold, and without waiting on rename_lock, which d_move
+ * holds while it waits for that d_lock. A concurrent rename can pair
+ * the length of one name with the other name, so the length used is
+ * that of the name actually read: up to its NUL, and never past the
+ * inline buffer, which d_move may be copying over. The match can go
+ * either way, as it could have a moment earlier, but stays within the
+ * name.
+ */
+static int
+nvfs_filter_name(struct dentry *dentry, const char *str, int suffix)
+{
+	int		hit = 0;
+	size_t		len = strlen(str),
+			nlen;
+	const unsigned char *name;
+
+	ENTER;
+
+	if (!dentry)
+		goto out;
+
+	rcu_read_lock();
+	name = ACCESS_ONCE(dentry->d_name.name);
+	nlen = ACCESS_ONCE(dentry->d_name.len);
+	if (name == dentry->d_iname)
+		nlen = MIN(nlen, DNAME_INLINE_LEN - 1);
+	nlen = strnlen((const char *)name, nlen);
+	if (len <= nlen)
+		hit = !memcmp(name + (suffix ? nlen - len : 0), str, len);
+	rcu_read_unlock();
+out:
+	EXIT_RET(hit);
+}
+
+/**
+ * nvfs_filter_load - fetch a field for NVFS_FLT_LD
+ * @field: NVFS_FLD_*, already checked
+ * @ev: operation being filtered
+ */
+static u64
+nvfs_filter_load(unsigned int field, const struct nvfs_event *ev)
+{
+	u64		val = 0;
+	struct inode	*inode = ev->upper ? ev->upper->d_inode : NULL;
+
+	ENTER;
+
+	switch (field) {
+	case NVFS_FLD_OP:
+		val = ev->op;
+		break;
+	case NVFS_FLD_FLAGS:
+		val = ev->flags;
+		break;
+	case NVFS_FLD_OFFSET:
+		val = ev->offset;
+		break;
+	case NVFS_FLD_COUNT:
+		val = ev->count;
+		break;
+	}
+	if (!inode)
+		goto out;
+
+	switch (field) {
+	case NVFS_FLD_TYPE:
+		val = inode->i_mode & S_IFMT;
+		break;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0)
+	case NVFS_FLD_UID:
+		val = from_kuid(&init_user_ns, inode->i_uid);
+		break;
+	case NVFS_FLD_GID:
+		val = from_kgid(&init_user_ns, inode->i_gid);
+		break;
+#else
+	case NVFS_FLD_UID:
+		val = inode->i_uid;
+		break;
+	case NVFS_FLD_GID:
+		val = inode->i_gid;
+		break;
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(3,5,0) */
+	case NVFS_FLD_SIZE:
+		val = i_size_read(inode);
+		break;
+	}
+out:
+	EXIT_RET(val);
+}
+
+/**
+ * nvfs_filter_run - run a checked program over an operation
+ * @f: program that passed nvfs_filter_check
+ * @ev: operation, as far as it is known at the hook site
+ *
+ * Returns nonzero if the consumer should see the operation.
+ */
+int
+nvfs_filter_run(const struct nvfs_filter *f, const struct nvfs_event *ev)
+{
+	int				hit,
+					ret;
+	u64				a = 0;
+	const struct nvfs_filter_insn	*pc;
+
+	ENTER;
+
+	for (pc = f->insns; ; pc++) {
+		switch (pc->code) {
+		case NVFS_FLT_LD:
+			a = nvfs_filter_load(pc->k, ev);
+			continue;
+		case NVFS_FLT_JEQ:
+			hit = a == pc->k;
+			break;
+		case NVFS_FLT_JGT:
+			hit = a > pc->k;
+			break;
+		case NVFS_FLT_JGE:
+			hit = a >= pc->k;
+			break;
+		case NVFS_FLT_JSET:
+			hit = (a & pc->k) != 0;
+			break;
+		case NVFS_FLT_JSUFFIX:
+			hit = nvfs_filter_name(ev->upper, pc->str, 1);
+			break;
+		case NVFS_FLT_JPREFIX:
+			hit = nvfs_filter_name(ev->upper, pc->str, 0);
+			break;
+		default:
+			/* NVFS_FLT_RET */
+			ret = pc->k != 0;
+			goto out;
+		}
+		pc += hit ? pc->jt : pc->jf;
+	}
+out:
+	EXIT_RET(ret);
+}
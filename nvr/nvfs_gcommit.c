@@ -0,0 +1,187 @@
+#include "nvfs.h"
+#include <linux/delay.h>
+#include <linux/completion.h>
+#include <linux/hrtimer.h>
+#include <linux/blkdev.h>
+
+/*
+ * Group commit. On a mount with the fsync_group option, an fsync writes
+ * back and waits on the file's own data, hands its inode to the lower
+ * filesystem, and then joins a batch: the first to arrive leads it,
+ * waits that many microseconds for others to join, and syncs the lower
+ * filesystem once for all of them, as sync(2) would, then flushes the
+ * disk's write cache. On a journaling filesystem (ext4, XFS and the
+ * like) every metadata change is in the journal by then, so one commit
+ * makes all the files durable, where calling each file's fsync would
+ * commit once per file. A batch only closes once its leader may sync,
+ * so fsyncs that arrive while another batch is syncing gather into the
+ * next one.
+ *
+ * It is off unless asked for on the mount, since a sync of the whole
+ * filesystem costs more than an fsync where little else is dirty. Lower
+ * filesystems without sync_fs always get the plain fsync.
+ */
+
+struct nvfs_gcommit {
+	struct completion	done;
+	int			users;		/* under wsi_gc_lock */
+	int			err;
+};
+
+/**
+ * nvfs_gcommit_wanted - whether an fsync should go through a batch
+ * @sb: nvfs superblock the file is on
+ */
+int
+nvfs_gcommit_wanted(struct super_block *sb)
+{
+	return SUPERBLOCK_TO_PRIVATE(sb)->wsi_gc_us &&
+		SUPERBLOCK_TO_LOWER(sb)->s_op->sync_fs;
+}
+
+/**
+ * nvfs_gcommit_wait - let the rest of a batch catch up
+ *
+ * Before 2.6.28 there is no high resolution sleep, and the wait is
+ * rounded up to a whole jiffy, 1 to 10ms depending on HZ, however small
+ * the mount's fsync_group is.
+ */
+static void
+nvfs_gcommit_wait(struct nvfs_sb_info *sbi)
+{
+	unsigned int	us = sbi->wsi_gc_us;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(2,6,36)
+	ktime_t		t = ktime_set(us / USEC_PER_SEC,
+				(us % USEC_PER_SEC) * NSEC_PER_USEC);
+#endif
+
+	ENTER;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,36)
+	usleep_range(us, us + us / 4 + 1);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+	set_current_state(TASK_UNINTERRUPTIBLE);
+	schedule_hrtimeout(&t, HRTIMER_MODE_REL);
+#else
+	schedule_timeout_uninterruptible(usecs_to_jiffies(us));
+#endif
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_gcommit_flush - empty the write cache of a lower filesystem's disk
+ * @lower_sb: lower superblock
+ *
+ * ->sync_fs only flushes the cache when it has a journal commit to make,
+ * and a batch of overwrites may leave it none. A device without a cache
+ * to flush is not an error.
+ */
+static int
+nvfs_gcommit_flush(struct super_block *lower_sb)
+{
+	int	err = 0;
+
+	ENTER;
+
+	if (!lower_sb->s_bdev)
+		goto out;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,35)
+	err = blkdev_issue_flush(lower_sb->s_bdev, NULL);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(2,6,37)
+	err = blkdev_issue_flush(lower_sb->s_bdev, GFP_KERNEL, NULL,
+			BLKDEV_IFL_WAIT);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+	err = blkdev_issue_flush(lower_sb->s_bdev, GFP_KERNEL, NULL);
+#elif LINUX_VERSION_CODE < KERNEL_VERSION(5,12,0)
+	err = blkdev_issue_flush(lower_sb->s_bdev, GFP_KERNEL);
+#else
+	err = blkdev_issue_flush(lower_sb->s_bdev);
+#endif
+	if (err == -EOPNOTSUPP)
+		err = 0;
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_gcommit_fsync - fsync a file as part of a group commit
+ * @sb: nvfs superblock
+ * @lower_file: file to sync
+ *
+ * Returns the result of writing back the file's data, or failing that
+ * of the commit that covered it.
+ */
+int
+nvfs_gcommit_fsync(struct super_block *sb, struct file *lower_file)
+{
+	int			err,
+				lead = 0;
+	struct nvfs_sb_info	*sbi = SUPERBLOCK_TO_PRIVATE(sb);
+	struct super_block	*lower_sb = SUPERBLOCK_TO_LOWER(sb);
+	struct nvfs_gcommit	*b,
+				*new;
+
+	ENTER;
+
+	err = filemap_write_and_wait(lower_file->f_dentry->d_inode->i_mapping);
+	if (err)
+		goto out;
+	/*
+	 * Without waiting: a journaling filesystem has the inode in its
+	 * journal already, and one without puts it in the buffer cache,
+	 * which the batch writes out.
+	 */
+	err = write_inode_now(lower_file->f_dentry->d_inode, 0);
+	if (err)
+		goto out;
+
+	new = kmalloc(sizeof(*new), GFP_KERNEL);
+	if (!new) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	spin_lock(&sbi->wsi_gc_lock);
+	b = sbi->wsi_gc_open;
+	if (!b) {
+		b = new;
+		new = NULL;
+		init_completion(&b->done);
+		b->users = 0;
+		b->err = 0;
+		sbi->wsi_gc_open = b;
+		lead = 1;
+	}
+	b->users++;
+	spin_unlock(&sbi->wsi_gc_lock);
+	kfree(new);
+
+	if (lead) {
+		nvfs_gcommit_wait(sbi);
+		/* one sync at a time; the next batch fills up meanwhile */
+		mutex_lock(&sbi->wsi_gc_mutex);
+		spin_lock(&sbi->wsi_gc_lock);
+		sbi->wsi_gc_open = NULL;
+		spin_unlock(&sbi->wsi_gc_lock);
+		/* as sync_filesystem(), against a racing remount or freeze */
+		down_read(&lower_sb->s_umount);
+		b->err = lower_sb->s_op->sync_fs(lower_sb, 1);
+		if (!b->err && lower_sb->s_bdev)
+			b->err = sync_blockdev(lower_sb->s_bdev);
+		up_read(&lower_sb->s_umount);
+		if (!b->err)
+			b->err = nvfs_gcommit_flush(lower_sb);
+		mutex_unlock(&sbi->wsi_gc_mutex);
+		complete_all(&b->done);
+	} else
+		wait_for_completion(&b->done);
+
+	err = b->err;
+	spin_lock(&sbi->wsi_gc_lock);
+	if (--b->users)
+		b = NULL;
+	spin_unlock(&sbi->wsi_gc_lock);
+	kfree(b);
+out:
+	EXIT_RET(err);
+}
@@ -1,16 +1,32 @@
 #include "nvfs.h"
 
-#define I_CB(op, func, ...) do {					\
-	struct nvfs_callback_info       *cb;				\
-	struct list_head		*tmp,				\
-					*safe;				\
-	list_for_each_safe(tmp, safe, &nvfs_callbacks) {		\
-		cb = list_entry(tmp, struct nvfs_callback_info, next);  \
-		if (cb && cb->op && cb->op->func)			\
-			cb->op->func(__VA_ARGS__);			\
+#define I_CB(dentry, op, func, ...) \
+	NVFS_CB((dentry)->d_sb, dentry, op, func, __VA_ARGS__)
+
+/*
+ * Callback for operations shared by all three inode tables; the table is
+ * picked by the lower inode's type. @ctx may be NULL.
+ */
+#define I_CB_MODE(sb, ctx, mode, func, ...) do {			\
+	if (nvfs_hooks_active()) {					\
+		if (S_ISLNK(mode))					\
+			NVFS_CB(sb, ctx, sym_i_op, func, __VA_ARGS__);	\
+		else if (S_ISDIR(mode))					\
+			NVFS_CB(sb, ctx, dir_i_op, func, __VA_ARGS__);	\
+		else							\
+			NVFS_CB(sb, ctx, reg_i_op, func, __VA_ARGS__);	\
 	}								\
 } while (0)
 
+/* whether anyone hooks an operation I_CB_MODE would dispatch */
+#define I_HOOKED_MODE(sb, mode, func)					\
+	(S_ISLNK(mode) ? NVFS_HOOKED(sb, sym_i_op, func) :		\
+	 S_ISDIR(mode) ? NVFS_HOOKED(sb, dir_i_op, func) :		\
+	 NVFS_HOOKED(sb, reg_i_op, func))
+
+/* post events name the inode an op left behind, else the directory */
+#define POST_INODE(dentry, dir) ((dentry)->d_inode ? (dentry)->d_inode : (dir))
+
 /**
  * nvfs_lock_parent - get and lock a dentry's parent
  * @dentry: dentry who's parent to lock
@@ -22,7 +38,7 @@ nvfs_lock_parent(struct dentry *dentry)
 
 	ENTER;
 	lock_inode(dir->d_inode);
-	EXIT_RET(dir);
+	EXIT_RET_PTR(dir);
 }
 
 /**
@@ -38,6 +54,135 @@ unlock_dir(struct dentry *dir)
 	EXIT_NORET;
 }
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,7,0)
+/**
+ * nvfs_lookup_cached - look a name up in the lower dcache only
+ * @dir: lower directory
+ * @name: name to look for
+ * @len: its length
+ *
+ * Returns the lower dentry with a reference held, or NULL if it is not
+ * cached. Names in a lower directory with its own d_hash or
+ * d_revalidate are left to lookup_one_len, which knows how to call them.
+ */
+static struct dentry *
+nvfs_lookup_cached(struct dentry *dir, const char *name, unsigned int len)
+{
+	struct qstr	this;
+	struct dentry	*dentry = NULL;
+
+	ENTER;
+
+	if (dir->d_op && (dir->d_op->d_hash || dir->d_op->d_revalidate))
+		goto out;
+
+	this.name = name;
+	this.len = len;
+	this.hash = full_name_hash(name, len);
+	dentry = d_lookup(dir, &this);
+out:
+	EXIT_RET_PTR(dentry);
+}
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(4,7,0) */
+
+/**
+ * nvfs_lookup_lower - look a dentry's name up in the lower directory
+ * @dentry: nvfs dentry, not yet attached to a lower one
+ *
+ * Returns the lower dentry with a reference held.
+ */
+static struct dentry *
+nvfs_lookup_lower(struct dentry *dentry)
+{
+	const char	*name = dentry->d_name.name;
+	unsigned int	namelen = dentry->d_name.len;
+	struct dentry	*lower_dentry,
+			*lower_dir_dentry = nvfs_lower_dentry(dentry->d_parent);
+
+	ENTER;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0)
+	lower_dentry = lookup_one_len_unlocked(name, lower_dir_dentry,
+			namelen);
+#else
+	lower_dentry = nvfs_lookup_cached(lower_dir_dentry, name, namelen);
+	if (!lower_dentry) {
+		lock_inode(lower_dir_dentry->d_inode);
+		lower_dentry = lookup_one_len(name, lower_dir_dentry, namelen);
+		unlock_inode(lower_dir_dentry->d_inode);
+	}
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(4,7,0) */
+
+	EXIT_RET_PTR(lower_dentry);
+}
+
+/**
+ * nvfs_attach_lower - give a dentry its private data
+ * @dentry: nvfs dentry
+ * @lower_dentry: its lower dentry, whose reference it takes over
+ */
+static int
+nvfs_attach_lower(struct dentry *dentry, struct dentry *lower_dentry)
+{
+	int			err = -ENOMEM;
+	struct nvfs_dentry_info	*info;
+
+	ENTER;
+
+	info = kmalloc(sizeof(struct nvfs_dentry_info), GFP_KERNEL);
+	if (!info)
+		goto out;
+	info->wdi_dentry = lower_dentry;
+	info->wdi_mnt = mntget(DENTRY_TO_LVFSMNT(dentry->d_parent));
+	info->wdi_time = jiffies;
+	/* RCU-walk may find it as soon as it is set */
+	smp_wmb();
+	DENTRY_TO_PRIVATE_SM(dentry) = info;
+	err = 0;
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_back_negative - give a negative dentry a lower one before use
+ * @dentry: nvfs dentry about to be created, parent locked
+ *
+ * A name its directory's filter rules out is looked up without a lower
+ * dentry (see nvfs_bloom.c). Lookups that say they are for a create or
+ * rename do not use the filter, and d_revalidate sends such a dentry
+ * back to lookup for them, so this is for whatever still gets here: the
+ * name is looked up in the lower directory and the result attached. If
+ * the name is there after all, it was created behind this mount's back;
+ * the filter learns it, and the operation meets the lower file as it
+ * would on the lower filesystem, failing with -EEXIST or, for a rename,
+ * replacing it. d_revalidate drops a dentry left negative over a
+ * positive lower one.
+ */
+static int
+nvfs_back_negative(struct dentry *dentry)
+{
+	int		err = 0;
+	struct dentry	*lower_dentry;
+
+	ENTER;
+
+	if (DENTRY_TO_PRIVATE(dentry))
+		goto out;
+
+	lower_dentry = nvfs_lookup_lower(dentry);
+	if (IS_ERR(lower_dentry)) {
+		err = PTR_ERR(lower_dentry);
+		goto out;
+	}
+	if (lower_dentry->d_inode)
+		nvfs_bloom_add(dentry->d_parent->d_inode, &dentry->d_name);
+	err = nvfs_attach_lower(dentry, lower_dentry);
+	if (err)
+		dput(lower_dentry);
+out:
+	EXIT_RET(err);
+}
+
 /**
  * nvfs_create - call the underlying create function
  * @dir: directory in which to create
@@ -57,6 +202,9 @@ nvfs_create(struct inode *dir, struct dentry *dentry, int mode,
 	NVFS_ND_DECLARATIONS;
 
 	ENTER;
+	err = nvfs_back_negative(dentry);
+	if (err)
+		goto out;
 	lower_dentry = nvfs_lower_dentry(dentry);
 	lower_mount = DENTRY_TO_LVFSMNT(dentry);
 
@@ -65,6 +213,11 @@ nvfs_create(struct inode *dir, struct dentry *dentry, int mode,
 	if (IS_ERR(lower_dir_dentry))
 		goto out;
 
+	I_CB(dentry, dir_i_op, create, lower_dir_dentry->d_inode,
+			lower_dentry, mode, nd);
+	NVFS_EVENT(create, dentry, lower_dir_dentry->d_inode, lower_dentry,
+			.mode = mode);
+
 	NVFS_ND_SAVE_ARGS(dentry, lower_dentry, lower_mount);
 
 	err = vfs_create(lower_dir_dentry->d_inode, lower_dentry, mode, nd);
@@ -81,9 +234,10 @@ nvfs_create(struct inode *dir, struct dentry *dentry, int mode,
 
 
 out_lock:
+	NVFS_EVENT_POST(create, err, dentry,
+			POST_INODE(lower_dentry, lower_dir_dentry->d_inode),
+			lower_dentry, .mode = mode);
 	unlock_dir(lower_dir_dentry);
-	I_CB(dir_i_op, create, lower_dir_dentry->d_inode,
-			lower_dentry, mode, nd);
 out:
 	EXIT_RET(err);
 }
@@ -93,32 +247,46 @@ out:
  * nvfs_lookup - call the underlying lookup function
  * @dir: directory in which to look
  * @dentry: dentry to look for
- * @unused: unused
+ * @nd: lookup in progress
+ *
+ * The lower directory is not locked for a name in the lower dcache, and
+ * from 4.7 on, where the VFS does lookups in parallel, it is only locked
+ * shared for one that is not. An inode already in use is found rather
+ * than set up again, and a directory's existing alias is used instead of
+ * @dentry, so concurrent lookups agree on the result. A name the
+ * directory's filter rules out gets a negative dentry with no lower one,
+ * unless it is about to be created.
  */
 static struct dentry *
-nvfs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *unused)
+nvfs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *nd)
 {
 	int		err = 0;
-	const char	*name;
-	unsigned int	namelen;
-	struct dentry	*lower_dentry = NULL,
-			*lower_dir_dentry;
-	struct vfsmount	*lower_mount;
+	struct dentry	*lower_dentry,
+			*lower_dir_dentry,
+			*ret = NULL;
+	struct inode	*inode;
 
 	ENTER;
 	lower_dir_dentry = nvfs_lower_dentry(dentry->d_parent);
-	name = dentry->d_name.name;
-	namelen = dentry->d_name.len;
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
 	dentry->d_op = &nvfs_dops;
+#else
+	/* sets the DCACHE_OP_* flags the VFS goes by */
+	d_set_d_op(dentry, &nvfs_dops);
+#endif
 
-	lock_inode(lower_dir_dentry->d_inode);
-	lower_dentry = lookup_one_len(name, lower_dir_dentry, namelen);
-	unlock_inode(lower_dir_dentry->d_inode);
+	/* a sure miss, unless lookup callbacks want the lower dentry */
+	if (!NVFS_FOR_CREATE(nd) && nvfs_bloom_absent(dir, &dentry->d_name) &&
+	    !NVFS_HOOKED(dir->i_sb, dir_i_op, lookup)) {
+		d_add(dentry, NULL);
+		goto out_ret;
+	}
 
-	I_CB(dir_i_op, lookup, lower_dir_dentry->d_inode, lower_dentry, unused);
+	lower_dentry = nvfs_lookup_lower(dentry);
 
-	lower_mount = mntget(DENTRY_TO_LVFSMNT(dentry->d_parent));
+	I_CB(dentry, dir_i_op, lookup, lower_dir_dentry->d_inode, lower_dentry,
+			nd);
 
 	if (IS_ERR(lower_dentry)) {
 		printk(KERN_ERR "ERR from lower_dentry!!!\n");
@@ -127,41 +295,44 @@ nvfs_lookup(struct inode *dir, struct dentry *dentry, struct nameidata *unused)
 	}
 
 	nvfs_copy_attr_atime(dir, lower_dir_dentry->d_inode);
-	DENTRY_TO_PRIVATE_SM(dentry) = (struct nvfs_dentry_info *)
-		kmalloc(sizeof(struct nvfs_dentry_info), GFP_KERNEL);
-	if (!DENTRY_TO_PRIVATE(dentry)) {
-		err = -ENOMEM;
-		goto out_dput;
+	err = nvfs_attach_lower(dentry, lower_dentry);
+	if (err) {
+		dput(lower_dentry);
+		goto out;
 	}
-	DENTRY_TO_PRIVATE(dentry)->wdi_dentry = lower_dentry;
-	DENTRY_TO_PRIVATE(dentry)->wdi_mnt = lower_mount;
-
 
 	/*
 	** We need to handle negative dentries
 	*/
 	if (!lower_dentry->d_inode) {
+		nvfs_bloom_miss(dentry);
 		d_add(dentry, NULL);
 		goto out;
 	}
+	nvfs_bloom_add(dir, &dentry->d_name);
 
-	err = nvfs_interpose(lower_dentry, dentry, dir->i_sb, 1);
-	if (err)
+	inode = nvfs_iget(dir->i_sb, lower_dentry->d_inode);
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
 		goto out_free;
+	}
+	nvfs_copy_attr_all(inode, lower_dentry->d_inode);
 
-	goto out;
+	/* @dentry and its lower dentry go with dput if an alias is used */
+	ret = d_splice_alias(inode, dentry);
+	goto out_ret;
 
 out_free:
 	d_drop(dentry);
+	mntput(DENTRY_TO_LVFSMNT(dentry));
 	kfree(DENTRY_TO_PRIVATE(dentry));
 	DENTRY_TO_PRIVATE_SM(dentry) = NULL;
-
-out_dput:
-	if (lower_dentry)
-		dput(lower_dentry);
+	dput(lower_dentry);
 
 out:
-	EXIT_RET(ERR_PTR(err));
+	ret = ERR_PTR(err);
+out_ret:
+	EXIT_RET_PTR(ret);
 }
 
 
@@ -182,6 +353,9 @@ nvfs_link(struct dentry *old_dentry, struct inode *dir,
 			*lower_dir_dentry;
 
 	ENTER;
+	err = nvfs_back_negative(new_dentry);
+	if (err)
+		goto out_ret;
 	lower_old_dentry = nvfs_lower_dentry(old_dentry);
 	lower_new_dentry = nvfs_lower_dentry(new_dentry);
 
@@ -189,8 +363,12 @@ nvfs_link(struct dentry *old_dentry, struct inode *dir,
 	dget(lower_new_dentry);
 	lower_dir_dentry = nvfs_lock_parent(lower_new_dentry);
 
-	I_CB(dir_i_op, link, lower_old_dentry, lower_dir_dentry->d_inode,
-		lower_new_dentry);
+	I_CB(new_dentry, dir_i_op, link, lower_old_dentry,
+			lower_dir_dentry->d_inode, lower_new_dentry);
+	/* the event goes through the new name; send the old one's writes */
+	nvfs_coalesce_flush(old_dentry->d_inode);
+	NVFS_EVENT(link, new_dentry, lower_dir_dentry->d_inode,
+			lower_new_dentry, .dentry2 = lower_old_dentry);
 
 	err = lower_dir_dentry->d_inode->i_op->link(lower_old_dentry,
 			lower_dir_dentry->d_inode, lower_new_dentry);
@@ -207,12 +385,16 @@ nvfs_link(struct dentry *old_dentry, struct inode *dir,
 		INODE_TO_LOWER(old_dentry->d_inode)->i_nlink;
 
 out_lock:
+	NVFS_EVENT_POST(link, err, new_dentry,
+			POST_INODE(lower_new_dentry, lower_dir_dentry->d_inode),
+			lower_new_dentry, .dentry2 = lower_old_dentry);
 	unlock_dir(lower_dir_dentry);
 	dput(lower_new_dentry);
 	dput(lower_old_dentry);
 	if (!new_dentry->d_inode)
 		d_drop(new_dentry);
 
+out_ret:
 	EXIT_RET(err);
 }
 
@@ -228,6 +410,9 @@ nvfs_link(struct dentry *old_dentry, struct inode *dir,
 			*lower_dir_dentry;
 
 	ENTER;
+	err = nvfs_back_negative(new_dentry);
+	if (err)
+		goto out_ret;
 	lower_old_dentry = nvfs_lower_dentry(old_dentry);
 	lower_new_dentry = nvfs_lower_dentry(new_dentry);
 
@@ -235,8 +420,12 @@ nvfs_link(struct dentry *old_dentry, struct inode *dir,
 	dget(lower_new_dentry);
 	lower_dir_dentry = nvfs_lock_parent(lower_new_dentry);
 
-	I_CB(dir_i_op, link, lower_old_dentry, lower_dir_dentry->d_inode,
-			lower_new_dentry);
+	I_CB(new_dentry, dir_i_op, link, lower_old_dentry,
+			lower_dir_dentry->d_inode, lower_new_dentry);
+	/* the event goes through the new name; send the old one's writes */
+	nvfs_coalesce_flush(old_dentry->d_inode);
+	NVFS_EVENT(link, new_dentry, lower_dir_dentry->d_inode,
+			lower_new_dentry, .dentry2 = lower_old_dentry);
 
 
 	err = vfs_link(lower_old_dentry,
@@ -255,12 +444,16 @@ nvfs_link(struct dentry *old_dentry, struct inode *dir,
 		INODE_TO_LOWER(old_dentry->d_inode)->i_nlink;
 
 out_lock:
+	NVFS_EVENT_POST(link, err, new_dentry,
+			POST_INODE(lower_new_dentry, lower_dir_dentry->d_inode),
+			lower_new_dentry, .dentry2 = lower_old_dentry);
 	unlock_dir(lower_dir_dentry);
 	dput(lower_new_dentry);
 	dput(lower_old_dentry);
 	if (!new_dentry->d_inode)
 		d_drop(new_dentry);
 
+out_ret:
 	EXIT_RET(err);
 }
 #endif /* SUSE */
@@ -285,7 +478,8 @@ nvfs_unlink(struct inode *dir, struct dentry *dentry)
 	lower_dir = INODE_TO_LOWER(dir);
 	lower_dentry = nvfs_lower_dentry(dentry);
 
-	I_CB(dir_i_op, unlink, lower_dir, lower_dentry);
+	I_CB(dentry, dir_i_op, unlink, lower_dir, lower_dentry);
+	NVFS_EVENT(unlink, dentry, lower_dir, lower_dentry);
 
 	dget(dentry);
 	lower_dir_dentry = nvfs_lock_parent(lower_dentry);
@@ -306,6 +500,8 @@ out_lock:
 	dentry->d_inode->i_nlink = INODE_TO_LOWER(dentry->d_inode)->i_nlink;
 	nvfs_copy_attr_ctime(dentry->d_inode, dir);
 
+	NVFS_EVENT_POST(unlink, err, dentry,
+			POST_INODE(lower_dentry, lower_dir), lower_dentry);
 	unlock_dir(lower_dir_dentry);
 
 	if (!err)
@@ -331,7 +527,8 @@ nvfs_unlink(struct inode *dir, struct dentry *dentry)
 	lower_dir = INODE_TO_LOWER(dir);
 	lower_dentry = nvfs_lower_dentry(dentry);
 
-	I_CB(dir_i_op, unlink, lower_dir, lower_dentry);
+	I_CB(dentry, dir_i_op, unlink, lower_dir, lower_dentry);
+	NVFS_EVENT(unlink, dentry, lower_dir, lower_dentry);
 
 	dget(dentry);
 	lower_dir_dentry = nvfs_lock_parent(lower_dentry);
@@ -352,6 +549,8 @@ out_lock:
 	dentry->d_inode->i_nlink = INODE_TO_LOWER(dentry->d_inode)->i_nlink;
 	nvfs_copy_attr_ctime(dentry->d_inode, dir);
 
+	NVFS_EVENT_POST(unlink, err, dentry,
+			POST_INODE(lower_dentry, lower_dir), lower_dentry);
 	unlock_dir(lower_dir_dentry);
 
 	if (!err)
@@ -379,13 +578,17 @@ nvfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 			*lower_dir_dentry;
 
 	ENTER;
+	err = nvfs_back_negative(dentry);
+	if (err)
+		goto out_ret;
 	lower_dentry = nvfs_lower_dentry(dentry);
 
 	dget(lower_dentry);
 	lower_dir_dentry = nvfs_lock_parent(lower_dentry);
 
-	I_CB(dir_i_op, symlink, lower_dir_dentry->d_inode, lower_dentry,
+	I_CB(dentry, dir_i_op, symlink, lower_dir_dentry->d_inode, lower_dentry,
 			symname);
+	NVFS_EVENT(symlink, dentry, lower_dir_dentry->d_inode, lower_dentry);
 
 	lower_dir_inode = lower_dir_dentry->d_inode;
 	err = lower_dir_inode->i_op->symlink(lower_dir_dentry->d_inode,
@@ -400,11 +603,15 @@ nvfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 	nvfs_copy_attr_timesizes(dir, lower_dir_dentry->d_inode);
 
 out_lock:
+	NVFS_EVENT_POST(symlink, err, dentry,
+			POST_INODE(lower_dentry, lower_dir_dentry->d_inode),
+			lower_dentry);
 	unlock_dir(lower_dir_dentry);
 	dput(lower_dentry);
 	if (!dentry->d_inode)
 		d_drop(dentry);
 
+out_ret:
 	EXIT_RET(err);
 }
 
@@ -419,13 +626,17 @@ nvfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 			*lower_dir_dentry;
 
 	ENTER;
+	err = nvfs_back_negative(dentry);
+	if (err)
+		goto out_ret;
 	lower_dentry = nvfs_lower_dentry(dentry);
 
 	dget(lower_dentry);
 	lower_dir_dentry = nvfs_lock_parent(lower_dentry);
 
-	I_CB(dir_i_op, symlink, lower_dir_dentry->d_inode, lower_dentry,
+	I_CB(dentry, dir_i_op, symlink, lower_dir_dentry->d_inode, lower_dentry,
 			symname);
+	NVFS_EVENT(symlink, dentry, lower_dir_dentry->d_inode, lower_dentry);
 
 	mode = S_IALLUGO;
 
@@ -441,11 +652,15 @@ nvfs_symlink(struct inode *dir, struct dentry *dentry, const char *symname)
 	nvfs_copy_attr_timesizes(dir, lower_dir_dentry->d_inode);
 
 out_lock:
+	NVFS_EVENT_POST(symlink, err, dentry,
+			POST_INODE(lower_dentry, lower_dir_dentry->d_inode),
+			lower_dentry);
 	unlock_dir(lower_dir_dentry);
 	dput(lower_dentry);
 	if (!dentry->d_inode)
 		d_drop(dentry);
 
+out_ret:
 	EXIT_RET(err);
 }
 #endif /* SUSE */
@@ -465,12 +680,17 @@ nvfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 			*lower_dir_dentry;
 
 	ENTER;
+	err = nvfs_back_negative(dentry);
+	if (err)
+		goto out_ret;
 	lower_dentry = nvfs_lower_dentry(dentry);
 
 	lower_dir_dentry = nvfs_lock_parent(lower_dentry);
 
-	I_CB(dir_i_op, mkdir, lower_dir_dentry->d_inode,
+	I_CB(dentry, dir_i_op, mkdir, lower_dir_dentry->d_inode,
 		lower_dentry, mode);
+	NVFS_EVENT(mkdir, dentry, lower_dir_dentry->d_inode, lower_dentry,
+			.mode = mode);
 
 	err = lower_dir_dentry->d_inode->i_op->mkdir(lower_dir_dentry->d_inode,
 			lower_dentry, mode);
@@ -486,10 +706,14 @@ nvfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 
 
 out:
+	NVFS_EVENT_POST(mkdir, err, dentry,
+			POST_INODE(lower_dentry, lower_dir_dentry->d_inode),
+			lower_dentry, .mode = mode);
 	unlock_dir(lower_dir_dentry);
 	if (!dentry->d_inode)
 		d_drop(dentry);
 
+out_ret:
 	EXIT_RET(err);
 }
 
@@ -503,11 +727,17 @@ nvfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 			*lower_dir_dentry;
 
 	ENTER;
+	err = nvfs_back_negative(dentry);
+	if (err)
+		goto out_ret;
 	lower_dentry = nvfs_lower_dentry(dentry);
 
 	lower_dir_dentry = nvfs_lock_parent(lower_dentry);
 
-	I_CB(dir_i_op, mkdir, lower_dir_dentry->d_inode, lower_dentry, mode);
+	I_CB(dentry, dir_i_op, mkdir, lower_dir_dentry->d_inode, lower_dentry,
+			mode);
+	NVFS_EVENT(mkdir, dentry, lower_dir_dentry->d_inode, lower_dentry,
+			.mode = mode);
 
 	err = vfs_mkdir(lower_dir_dentry->d_inode, lower_dentry, mode);
 	if (err || !lower_dentry->d_inode)
@@ -522,10 +752,14 @@ nvfs_mkdir(struct inode *dir, struct dentry *dentry, int mode)
 
 
 out:
+	NVFS_EVENT_POST(mkdir, err, dentry,
+			POST_INODE(lower_dentry, lower_dir_dentry->d_inode),
+			lower_dentry, .mode = mode);
 	unlock_dir(lower_dir_dentry);
 	if (!dentry->d_inode)
 		d_drop(dentry);
 
+out_ret:
 	EXIT_RET(err);
 }
 #endif
@@ -549,7 +783,8 @@ nvfs_rmdir(struct inode *dir, struct dentry *dentry)
 	dget(dentry);
 	lower_dir_dentry = nvfs_lock_parent(lower_dentry);
 
-	I_CB(dir_i_op, rmdir, lower_dir_dentry->d_inode, lower_dentry);
+	I_CB(dentry, dir_i_op, rmdir, lower_dir_dentry->d_inode, lower_dentry);
+	NVFS_EVENT(rmdir, dentry, lower_dir_dentry->d_inode, lower_dentry);
 
 	dget(lower_dentry);
 	err = lower_dir_dentry->d_inode->i_op->rmdir(lower_dir_dentry->d_inode,
@@ -563,6 +798,9 @@ out_lock:
 	nvfs_copy_attr_times(dir, lower_dir_dentry->d_inode);
 	dir->i_nlink =  lower_dir_dentry->d_inode->i_nlink;
 
+	NVFS_EVENT_POST(rmdir, err, dentry,
+			POST_INODE(lower_dentry, lower_dir_dentry->d_inode),
+			lower_dentry);
 	unlock_dir(lower_dir_dentry);
 
 	if (!err)
@@ -587,7 +825,8 @@ nvfs_rmdir(struct inode *dir, struct dentry *dentry)
 	dget(dentry);
 	lower_dir_dentry = nvfs_lock_parent(lower_dentry);
 
-	I_CB(dir_i_op, rmdir, lower_dir_dentry->d_inode, lower_dentry);
+	I_CB(dentry, dir_i_op, rmdir, lower_dir_dentry->d_inode, lower_dentry);
+	NVFS_EVENT(rmdir, dentry, lower_dir_dentry->d_inode, lower_dentry);
 
 	dget(lower_dentry);
 	err = vfs_rmdir(lower_dir_dentry->d_inode, lower_dentry);
@@ -600,6 +839,9 @@ out_lock:
 	nvfs_copy_attr_times(dir, lower_dir_dentry->d_inode);
 	dir->i_nlink =  lower_dir_dentry->d_inode->i_nlink;
 
+	NVFS_EVENT_POST(rmdir, err, dentry,
+			POST_INODE(lower_dentry, lower_dir_dentry->d_inode),
+			lower_dentry);
 	unlock_dir(lower_dir_dentry);
 
 	if (!err)
@@ -627,12 +869,17 @@ nvfs_mknod(struct inode *dir, struct dentry *dentry, int mode, dev_t dev)
 			*lower_dir_dentry;
 
 	ENTER;
+	err = nvfs_back_negative(dentry);
+	if (err)
+		goto out_ret;
 	lower_dentry = nvfs_lower_dentry(dentry);
 
 	lower_dir_dentry = nvfs_lock_parent(lower_dentry);
 
-	I_CB(dir_i_op, mknod, lower_dir_dentry->d_inode, lower_dentry,
+	I_CB(dentry, dir_i_op, mknod, lower_dir_dentry->d_inode, lower_dentry,
 			mode, dev);
+	NVFS_EVENT(mknod, dentry, lower_dir_dentry->d_inode, lower_dentry,
+			.mode = mode);
 
 	err = lower_dir_dentry->d_inode->i_op->mknod(lower_dir_dentry->d_inode,
 			lower_dentry, mode, dev);
@@ -645,10 +892,14 @@ nvfs_mknod(struct inode *dir, struct dentry *dentry, int mode, dev_t dev)
 	nvfs_copy_attr_timesizes(dir, lower_dir_dentry->d_inode);
 
 out:
+	NVFS_EVENT_POST(mknod, err, dentry,
+			POST_INODE(lower_dentry, lower_dir_dentry->d_inode),
+			lower_dentry, .mode = mode);
 	unlock_dir(lower_dir_dentry);
 	if (!dentry->d_inode)
 		d_drop(dentry);
 
+out_ret:
 	EXIT_RET(err);
 }
 
@@ -662,12 +913,17 @@ nvfs_mknod(struct inode *dir, struct dentry *dentry, int mode, dev_t dev)
 			*lower_dir_dentry;
 
 	ENTER;
+	err = nvfs_back_negative(dentry);
+	if (err)
+		goto out_ret;
 	lower_dentry = nvfs_lower_dentry(dentry);
 
 	lower_dir_dentry = nvfs_lock_parent(lower_dentry);
 
-	I_CB(dir_i_op, mknod, lower_dir_dentry->d_inode, lower_dentry,
+	I_CB(dentry, dir_i_op, mknod, lower_dir_dentry->d_inode, lower_dentry,
 			mode, dev);
+	NVFS_EVENT(mknod, dentry, lower_dir_dentry->d_inode, lower_dentry,
+			.mode = mode);
 
 	err = vfs_mknod(lower_dir_dentry->d_inode,
 			lower_dentry,
@@ -682,10 +938,14 @@ nvfs_mknod(struct inode *dir, struct dentry *dentry, int mode, dev_t dev)
 	nvfs_copy_attr_timesizes(dir, lower_dir_dentry->d_inode);
 
 out:
+	NVFS_EVENT_POST(mknod, err, dentry,
+			POST_INODE(lower_dentry, lower_dir_dentry->d_inode),
+			lower_dentry, .mode = mode);
 	unlock_dir(lower_dir_dentry);
 	if (!dentry->d_inode)
 		d_drop(dentry);
 
+out_ret:
 	EXIT_RET(err);
 }
 #endif /* SUSE */
@@ -709,6 +969,9 @@ nvfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 			*lower_new_dir_dentry;
 
 	ENTER;
+	err = nvfs_back_negative(new_dentry);
+	if (err)
+		goto out;
 
 	err = -EFAULT;
 
@@ -738,10 +1001,15 @@ nvfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	lower_new_dir_dentry = dget_parent(lower_new_dentry);
 
 	LOGIT(1, "entering CB\n");
-	I_CB(dir_i_op, rename, lower_old_dir_dentry->d_inode,
+	I_CB(old_dentry, dir_i_op, rename, lower_old_dir_dentry->d_inode,
 			lower_old_dentry,
 			lower_new_dir_dentry->d_inode,
 			lower_new_dentry);
+	/* writes to a file about to be replaced go out first */
+	if (new_dentry->d_inode)
+		nvfs_coalesce_flush(new_dentry->d_inode);
+	NVFS_EVENT(rename, old_dentry, lower_old_dir_dentry->d_inode,
+			lower_old_dentry, .dentry2 = lower_new_dentry);
 
 	LOGIT(1, "calling vfs_rename\n");
 	err = vfs_rename(lower_old_dir_dentry->d_inode, lower_old_dentry,
@@ -754,6 +1022,7 @@ nvfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	}
 
 	LOGIT(1, "going to copy attrs\n");
+	nvfs_bloom_add(new_dir, &new_dentry->d_name);
 	nvfs_copy_attr_all(new_dir, lower_new_dir_dentry->d_inode);
 	if (new_dir != old_dir) {
 		LOGIT(1, "copy attrs #2\n");
@@ -761,6 +1030,10 @@ nvfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	}
 
 out_lock:
+	NVFS_EVENT_POST(rename, err, old_dentry,
+			POST_INODE(lower_old_dentry,
+				lower_old_dir_dentry->d_inode),
+			lower_old_dentry, .dentry2 = lower_new_dentry);
 	LOGIT(1, "dput lower new\n");
 	dput(lower_new_dentry);
 	LOGIT(1, "dput lower old\n");
@@ -784,6 +1057,9 @@ nvfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 			*lower_new_dir_dentry;
 
 	ENTER;
+	err = nvfs_back_negative(new_dentry);
+	if (err)
+		goto out_ret;
 
 	lower_old_dentry = nvfs_lower_dentry(old_dentry);
 	lower_new_dentry = nvfs_lower_dentry(new_dentry);
@@ -794,9 +1070,14 @@ nvfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	lower_old_dir_dentry = dget_parent(lower_old_dentry);
 	lower_new_dir_dentry = dget_parent(lower_new_dentry);
 
-	I_CB(dir_i_op, rename, lower_old_dir_dentry->d_inode,
+	I_CB(old_dentry, dir_i_op, rename, lower_old_dir_dentry->d_inode,
 			lower_old_dentry, lower_new_dir_dentry->d_inode,
 			lower_new_dentry);
+	/* writes to a file about to be replaced go out first */
+	if (new_dentry->d_inode)
+		nvfs_coalesce_flush(new_dentry->d_inode);
+	NVFS_EVENT(rename, old_dentry, lower_old_dir_dentry->d_inode,
+			lower_old_dentry, .dentry2 = lower_new_dentry);
 
 	lock_rename(lower_old_dir_dentry, lower_new_dir_dentry);
 
@@ -807,6 +1088,7 @@ nvfs_rename(struct inode *old_dir, struct dentry *old_dentry,
 	if (err)
 		goto out_lock;
 
+	nvfs_bloom_add(new_dir, &new_dentry->d_name);
 	nvfs_copy_attr_all(new_dir, lower_new_dir_dentry->d_inode);
 	if (new_dir != old_dir)
 		nvfs_copy_attr_all(old_dir, lower_old_dir_dentry->d_inode);
@@ -816,10 +1098,15 @@ out_lock:
 	** unlock_rename will dput the new/old parent dentries whose refcnts
 	** were incremented via dget_parent above.
 	*/
+	NVFS_EVENT_POST(rename, err, old_dentry,
+			POST_INODE(lower_old_dentry,
+				lower_old_dir_dentry->d_inode),
+			lower_old_dentry, .dentry2 = lower_new_dentry);
 	dput(lower_new_dentry);
 	dput(lower_old_dentry);
 	unlock_rename(lower_old_dir_dentry, lower_new_dir_dentry);
 
+out_ret:
 	EXIT_RET(err);
 }
 #endif /* SUSE */
@@ -845,7 +1132,7 @@ nvfs_readlink(struct dentry *dentry, char *buf, int bufsiz)
 		goto out;
 	}
 
-	I_CB(sym_i_op, readlink, lower_dentry, buf, bufsiz);
+	I_CB(dentry, sym_i_op, readlink, lower_dentry, buf, bufsiz);
 
 	err = lower_dentry->d_inode->i_op->readlink(lower_dentry, buf, bufsiz);
 	if (err > 0)
@@ -900,7 +1187,7 @@ out:
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,13)
 	EXIT_RET(err);
 #else /* 2.6.13 or newer */
-	EXIT_RET(ERR_PTR(err));
+	EXIT_RET_PTR(ERR_PTR(err));
 #endif /* 2.6.13 or newer */
 }
 #endif
@@ -930,6 +1217,9 @@ nvfs_put_link(struct dentry *dentry, struct nameidata *nd, void *unused)
  * @inode: inode to check
  * @mask: what kind of check
  * @nd: nameidata for dentry we're checking
+ *
+ * In RCU-walk (IPERM_FLAG_RCU, then MAY_NOT_BLOCK) this returns -ECHILD
+ * for the VFS to retry in ref-walk if callbacks would have to run.
  */
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20) || DEBIAN
 static int
@@ -952,12 +1242,8 @@ nvfs_permission(struct inode *inode, int mask, struct nameidata *nd)
 				lower_mount);
 	}
 
-	if (S_ISLNK(lower_inode->i_mode))
-		I_CB(sym_i_op, permission, lower_inode, mask, nd);
-	else if (S_ISDIR(lower_inode->i_mode))
-		I_CB(dir_i_op, permission, lower_inode, mask, nd);
-	else
-		I_CB(reg_i_op, permission, lower_inode, mask, nd);
+	I_CB_MODE(inode->i_sb, NULL, lower_inode->i_mode, permission,
+			lower_inode, mask, nd);
 
 	err = permission(lower_inode, mask, nd);
 
@@ -967,28 +1253,50 @@ nvfs_permission(struct inode *inode, int mask, struct nameidata *nd)
 out:
 	EXIT_RET(err);
 }
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(3,1,0)
+static int
+nvfs_permission(struct inode *inode, int mask, unsigned int flags)
+{
+	int		err = -ECHILD;
+	struct inode	*lower_inode;
+
+	ENTER;
+	lower_inode = INODE_TO_LOWER(inode);
+
+	/* inode_permission cannot be asked not to block until 3.1 */
+	if (flags & IPERM_FLAG_RCU)
+		goto out;
+
+	I_CB_MODE(inode->i_sb, NULL, lower_inode->i_mode, permission,
+			lower_inode, mask, flags);
+
+	err = inode_permission(lower_inode, mask);
+out:
+	EXIT_RET(err);
+}
 #else
 static int
 nvfs_permission(struct inode *inode, int mask)
 {
-	int		err;
+	int		err = -ECHILD;
 	struct inode	*lower_inode;
 
-	printk(KERN_ERR "%s fixme\n", __FUNCTION__);
-	return 0;
-
 	ENTER;
 	lower_inode = INODE_TO_LOWER(inode);
 
-	if (S_ISLNK(lower_inode->i_mode))
-		I_CB(sym_i_op, permission, lower_inode, mask);
-	else if (S_ISDIR(lower_inode->i_mode))
-		I_CB(dir_i_op, permission, lower_inode, mask);
-	else
-		I_CB(reg_i_op, permission, lower_inode, mask);
+#ifdef MAY_NOT_BLOCK
+	/* RCU-walk; the lower filesystem sees MAY_NOT_BLOCK too */
+	if ((mask & MAY_NOT_BLOCK) &&
+	    I_HOOKED_MODE(inode->i_sb, lower_inode->i_mode, permission))
+		goto out;
+#endif
 
-	err = inode_permission(inode, mask);
+	I_CB_MODE(inode->i_sb, NULL, lower_inode->i_mode, permission,
+			lower_inode, mask);
 
+	err = inode_permission(lower_inode, mask);
+out:
 	EXIT_RET(err);
 }
 #endif /* > 2.6.20 */
@@ -1012,17 +1320,26 @@ nvfs_setattr(struct dentry *dentry, struct iattr *ia)
 	inode = dentry->d_inode;
 	lower_inode = INODE_TO_LOWER(inode);
 
-	if (S_ISLNK(lower_inode->i_mode))
-		I_CB(sym_i_op, setattr, lower_dentry, ia);
-	else if (S_ISDIR(lower_inode->i_mode))
-		I_CB(dir_i_op, setattr, lower_dentry, ia);
-	else
-		I_CB(reg_i_op, setattr, lower_dentry, ia);
+	/* buffered writes must not land after a truncate */
+	if (ia->ia_valid & ATTR_SIZE) {
+		err = nvfs_wcombine_flush_inode(inode);
+		if (err)
+			goto out;
+	}
 
-	lower_dentry->d_inode->i_op->setattr(lower_dentry, ia);
+	I_CB_MODE(dentry->d_sb, dentry, lower_inode->i_mode, setattr,
+			lower_dentry, ia);
+	NVFS_EVENT(setattr, dentry, lower_inode, lower_dentry,
+			.offset = ia->ia_size, .mode = ia->ia_valid);
 
-	nvfs_copy_attr_all(inode, lower_inode);
+	err = lower_dentry->d_inode->i_op->setattr(lower_dentry, ia);
+	NVFS_EVENT_POST(setattr, err, dentry, lower_inode, lower_dentry,
+			.offset = ia->ia_size, .mode = ia->ia_valid);
 
+	if (!err && (ia->ia_valid & ATTR_SIZE))
+		nvfs_dirty_resize(inode, i_size_read(inode), ia->ia_size);
+	nvfs_copy_attr_all(inode, lower_inode);
+out:
 	EXIT_RET(err);
 }
 
@@ -1041,17 +1358,26 @@ nvfs_setattr(struct dentry *dentry, struct iattr *ia)
 	inode = dentry->d_inode;
 	lower_inode = INODE_TO_LOWER(inode);
 
-	if (S_ISLNK(lower_inode->i_mode))
-		I_CB(sym_i_op, setattr, lower_dentry, ia);
-	else if (S_ISDIR(lower_inode->i_mode))
-		I_CB(dir_i_op, setattr, lower_dentry, ia);
-	else
-		I_CB(reg_i_op, setattr, lower_dentry, ia);
+	/* buffered writes must not land after a truncate */
+	if (ia->ia_valid & ATTR_SIZE) {
+		err = nvfs_wcombine_flush_inode(inode);
+		if (err)
+			goto out;
+	}
+
+	I_CB_MODE(dentry->d_sb, dentry, lower_inode->i_mode, setattr,
+			lower_dentry, ia);
+	NVFS_EVENT(setattr, dentry, lower_inode, lower_dentry,
+			.offset = ia->ia_size, .mode = ia->ia_valid);
 
 	err = notify_change(lower_dentry, ia);
+	NVFS_EVENT_POST(setattr, err, dentry, lower_inode, lower_dentry,
+			.offset = ia->ia_size, .mode = ia->ia_valid);
 
+	if (!err && (ia->ia_valid & ATTR_SIZE))
+		nvfs_dirty_resize(inode, i_size_read(inode), ia->ia_size);
 	nvfs_copy_attr_all(inode, lower_inode);
-
+out:
 	EXIT_RET(err);
 }
 #endif /* SUSE */
@@ -1073,11 +1399,104 @@ nvfs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *ks)
 	lower_dentry = nvfs_lower_dentry(dentry);
 	lower_mount = DENTRY_TO_LVFSMNT(dentry);
 
-	err = vfs_getattr(lower_mount, lower_dentry, ks);
+	/* the size includes what is still buffered */
+	err = nvfs_wcombine_flush_inode(dentry->d_inode);
+	if (!err)
+		err = vfs_getattr(lower_mount, lower_dentry, ks);
+
+	EXIT_RET(err);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+/**
+ * nvfs_fiemap - call the underlying fiemap function
+ * @inode: nvfs inode
+ * @fieinfo: request and where the extents go
+ * @start: first byte to map
+ * @len: bytes to map
+ *
+ * The lower filesystem checks the flags and fills in the user's buffer
+ * itself, so the extents reported are those of the lower file.
+ */
+static int
+nvfs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		u64 start, u64 len)
+{
+	int		err = -EOPNOTSUPP;
+	struct inode	*lower_inode;
+
+	ENTER;
+	lower_inode = INODE_TO_LOWER(inode);
+
+	if (!lower_inode->i_op || !lower_inode->i_op->fiemap)
+		goto out;
 
+	NVFS_CB(inode->i_sb, NULL, reg_i_op, fiemap, lower_inode, fieinfo,
+			start, len);
+	err = lower_inode->i_op->fiemap(lower_inode, fieinfo, start, len);
+out:
 	EXIT_RET(err);
 }
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28) */
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
+/**
+ * nvfs_fallocate - call the underlying fallocate function
+ * @inode: nvfs inode
+ * @mode: FALLOC_FL_* flags
+ * @offset: start of the range
+ * @len: length of the range
+ *
+ * Until 2.6.38 fallocate is an inode operation, called without a file
+ * or dentry, so only whole-mount consumers see the callback;
+ * nvfs_fallocate in nvfs_file.c replaces it after that. The events are
+ * raised on any dentry of the inode, which the file fallocate(2) was
+ * called on keeps around, and the first one flushes writes still being
+ * coalesced. The file's write combining buffer cannot be reached from
+ * here and is not flushed.
+ */
+static long
+nvfs_fallocate(struct inode *inode, int mode, loff_t offset, loff_t len)
+{
+	long		err = -EOPNOTSUPP;
+	loff_t		size;
+	struct inode	*lower_inode;
+	struct dentry	*dentry,
+			*lower_dentry = NULL;
+
+	ENTER;
+	lower_inode = INODE_TO_LOWER(inode);
+
+	if (!lower_inode->i_op || !lower_inode->i_op->fallocate)
+		goto out;
+
+	dentry = d_find_alias(inode);
+	if (dentry)
+		lower_dentry = nvfs_lower_dentry(dentry);
+
+	NVFS_CB(inode->i_sb, NULL, reg_i_op, fallocate, lower_inode, mode,
+			offset, len);
+	if (dentry)
+		NVFS_EVENT(fallocate, dentry, lower_inode, lower_dentry,
+				.offset = offset, .count = len, .mode = mode);
+	size = i_size_read(inode);
+	err = lower_inode->i_op->fallocate(lower_inode, mode, offset, len);
+	if (dentry) {
+		NVFS_EVENT_POST(fallocate, err, dentry, lower_inode,
+				lower_dentry,
+				.offset = offset, .count = len, .mode = mode);
+		dput(dentry);
+	}
+	if (err)
+		goto out;
+
+	nvfs_copy_attr_timesizes(inode, lower_inode);
+	nvfs_dirty_fallocate(inode, offset, len, size);
+out:
+	EXIT_RET(err);
+}
+#endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23) && ... */
 
 /* This is lifted from fs/xattr.c */
 static void *
@@ -1103,7 +1522,7 @@ xattr_alloc(size_t size, size_t limit)
 		ptr = vmalloc((unsigned long) size);
 
 out:
-	EXIT_RET(ptr);
+	EXIT_RET_PTR(ptr);
 }
 
 static void
@@ -1137,15 +1556,9 @@ nvfs_getxattr(struct dentry *dentry, const char *name, void *value, size_t size)
 
 	if (lower_dentry->d_inode->i_op->getxattr) {
 
-		if (S_ISLNK(lower_dentry->d_inode->i_mode))
-			I_CB(sym_i_op, getxattr, lower_dentry,
-					name, value, size);
-		else if (S_ISDIR(lower_dentry->d_inode->i_mode))
-			I_CB(dir_i_op, getxattr, lower_dentry,
-					name, value, size);
-		else
-			I_CB(reg_i_op, getxattr, lower_dentry,
-					name, value, size);
+		I_CB_MODE(dentry->d_sb, dentry,
+				lower_dentry->d_inode->i_mode, getxattr,
+				lower_dentry, name, value, size);
 
 		lock_inode(lower_dentry->d_inode);
 		err = lower_dentry->d_inode->i_op->getxattr(lower_dentry,
@@ -1178,19 +1591,18 @@ nvfs_setxattr(struct dentry *dentry, const char *name,
 
 	if (lower_dentry->d_inode->i_op->setxattr) {
 
-		if (S_ISLNK(lower_dentry->d_inode->i_mode))
-			I_CB(sym_i_op, setxattr, lower_dentry, name,
-				value, size, flags);
-		else if (S_ISDIR(lower_dentry->d_inode->i_mode))
-			I_CB(dir_i_op, setxattr, lower_dentry, name,
-					value, size, flags);
-		else
-			I_CB(reg_i_op, setxattr, lower_dentry, name,
-					value, size, flags);
+		I_CB_MODE(dentry->d_sb, dentry,
+				lower_dentry->d_inode->i_mode, setxattr,
+				lower_dentry, name, value, size, flags);
+		NVFS_EVENT(setxattr, dentry, lower_dentry->d_inode,
+				lower_dentry,
+				.count = size);
 
 		lock_inode(lower_dentry->d_inode);
 		err = lower_dentry->d_inode->i_op->setxattr(lower_dentry,
 				name, value, size, flags);
+		NVFS_EVENT_POST(setxattr, err, dentry, lower_dentry->d_inode,
+				lower_dentry, .count = size);
 		unlock_inode(lower_dentry->d_inode);
 	}
 
@@ -1214,16 +1626,17 @@ nvfs_removexattr(struct dentry *dentry, const char *name)
 
 	if (lower_dentry->d_inode->i_op->removexattr) {
 
-		if (S_ISLNK(lower_dentry->d_inode->i_mode))
-			I_CB(sym_i_op, removexattr, lower_dentry, name);
-		else if (S_ISDIR(lower_dentry->d_inode->i_mode))
-			I_CB(dir_i_op, removexattr, lower_dentry, name);
-		else
-			I_CB(reg_i_op, removexattr, lower_dentry, name);
+		I_CB_MODE(dentry->d_sb, dentry,
+				lower_dentry->d_inode->i_mode, removexattr,
+				lower_dentry, name);
+		NVFS_EVENT(removexattr, dentry, lower_dentry->d_inode,
+				lower_dentry);
 
 		lock_inode(lower_dentry->d_inode);
 		err = lower_dentry->d_inode->i_op->removexattr(lower_dentry,
 				name);
+		NVFS_EVENT_POST(removexattr, err, dentry,
+				lower_dentry->d_inode, lower_dentry);
 		unlock_inode(lower_dentry->d_inode);
 	}
 
@@ -1247,12 +1660,9 @@ nvfs_listxattr(struct dentry *dentry, char *list, size_t size)
 
 	if (lower_dentry->d_inode->i_op->listxattr) {
 
-		if (S_ISLNK(lower_dentry->d_inode->i_mode))
-			I_CB(sym_i_op, listxattr, lower_dentry, list, size);
-		else if (S_ISDIR(lower_dentry->d_inode->i_mode))
-			I_CB(dir_i_op, listxattr, lower_dentry, list, size);
-		else
-			I_CB(reg_i_op, listxattr, lower_dentry, list, size);
+		I_CB_MODE(dentry->d_sb, dentry,
+				lower_dentry->d_inode->i_mode, listxattr,
+				lower_dentry, list, size);
 
 		lock_inode(lower_dentry->d_inode);
 		err = lower_dentry->d_inode->i_op->listxattr(lower_dentry,
@@ -1308,4 +1718,11 @@ struct inode_operations nvfs_main_iops = {
 	.listxattr	= nvfs_listxattr,
 	.permission	= nvfs_permission,
 	.removexattr	= nvfs_removexattr,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+	.fiemap		= nvfs_fiemap,
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
+	.fallocate	= nvfs_fallocate,
+#endif
 };
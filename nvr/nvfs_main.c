@@ -1,28 +1,43 @@
 #include "nvfs.h"
+#include <linux/parser.h>
 
-struct list_head nvfs_callbacks;
+static struct list_head nvfs_callbacks;
+static LIST_HEAD(nvfs_supers);
+struct srcu_struct nvfs_cb_srcu;
+
+/*
+ * serializes the callback lists, nvfs_supers and rebuilds of the
+ * per mount dispatch snapshots
+ */
+static DEFINE_MUTEX(nvfs_cb_mutex);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+DEFINE_STATIC_KEY_FALSE(nvfs_hooks_key);
+#else
+int nvfs_hooks_enabled __read_mostly;
+static int nvfs_hooks_users;
+static DEFINE_MUTEX(nvfs_hooks_mutex);
+#endif
 
 /**
- * nvfs_interpose - stack dentries
- * @lower_dentry: "real" filesystem dentry
- * @dentry: upper "stacked" dentry
- * @sb: superblock containing @dentry
- * @flag: add or instantiate
+ * nvfs_iget - find or set up the upper inode for a lower one
+ * @sb: nvfs superblock
+ * @lower_inode: inode on the lower filesystem
+ *
+ * Returns the inode with a reference held, or an ERR_PTR. From 2.6.20 a
+ * new inode stays I_NEW, and so invisible to every other nvfs_iget for
+ * the same lower inode, until it is fully set up; concurrent lookups of
+ * one file all get the one inode, set up once.
  */
-int
-nvfs_interpose(struct dentry *lower_dentry, struct dentry *dentry,
-		struct super_block *sb, int flag)
+struct inode *
+nvfs_iget(struct super_block *sb, struct inode *lower_inode)
 {
-	int		err = 0;
-	struct inode	*inode,
-			*lower_inode;
+	struct inode	*inode;
 
 	ENTER;
 
-	lower_inode = lower_dentry->d_inode;
-
 	if (lower_inode->i_sb != SUPERBLOCK_TO_LOWER(sb)) {
-		err = -EXDEV;
+		inode = ERR_PTR(-EXDEV);
 		goto out;
 	}
 #if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
@@ -32,9 +47,17 @@ nvfs_interpose(struct dentry *lower_dentry, struct dentry *dentry,
 #endif
 
 	if (!inode) {
-		err = -EACCES;
+		inode = ERR_PTR(-EACCES);
 		goto out;
 	}
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+	if (!(inode->i_state & I_NEW))
+		goto out;
+	/* what iget had ->read_inode do */
+	inode->i_version++;
+	inode->i_op = &nvfs_main_iops;
+	inode->i_fop = &nvfs_main_fops;
+#endif
 
 	if (INODE_TO_LOWER(inode) == NULL)
 		INODE_TO_LOWER(inode) = igrab(lower_inode);
@@ -54,8 +77,41 @@ nvfs_interpose(struct dentry *lower_dentry, struct dentry *dentry,
 				lower_inode->i_rdev);
 
 
-	if (inode->i_mapping->a_ops != lower_inode->i_mapping->a_ops)
-		inode->i_mapping->a_ops = lower_inode->i_mapping->a_ops;
+	/* regular file I/O goes through the lower file; see nvfs_direct_IO */
+	if (S_ISREG(lower_inode->i_mode))
+		inode->i_data.a_ops = &nvfs_aops;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,20)
+	unlock_new_inode(inode);
+#endif
+out:
+	EXIT_RET_PTR(inode);
+}
+
+/**
+ * nvfs_interpose - stack dentries
+ * @lower_dentry: "real" filesystem dentry
+ * @dentry: upper "stacked" dentry
+ * @sb: superblock containing @dentry
+ * @flag: add or instantiate
+ */
+int
+nvfs_interpose(struct dentry *lower_dentry, struct dentry *dentry,
+		struct super_block *sb, int flag)
+{
+	int		err = 0;
+	struct inode	*inode,
+			*lower_inode;
+
+	ENTER;
+
+	lower_inode = lower_dentry->d_inode;
+
+	inode = nvfs_iget(sb, lower_inode);
+	if (IS_ERR(inode)) {
+		err = PTR_ERR(inode);
+		goto out;
+	}
 
 	if (flag)
 		d_add(dentry, inode);
@@ -63,6 +119,9 @@ nvfs_interpose(struct dentry *lower_dentry, struct dentry *dentry,
 		d_instantiate(dentry, inode);
 
 	nvfs_copy_attr_all(inode, lower_inode);
+	/* the name exists now, see nvfs_bloom.c */
+	if (!IS_ROOT(dentry))
+		nvfs_bloom_add(dentry->d_parent->d_inode, &dentry->d_name);
 out:
 	EXIT_RET(err)
 }
@@ -93,16 +152,83 @@ out:
 	EXIT_RET(err);
 }
 
+enum { Opt_pos_ttl, Opt_neg_ttl, Opt_fsync_group, Opt_err };
+
+static struct match_token nvfs_tokens[] = {
+	{ Opt_pos_ttl,	"pos_ttl=%u" },
+	{ Opt_neg_ttl,	"neg_ttl=%u" },
+	{ Opt_fsync_group, "fsync_group=%u" },
+	{ Opt_err,	NULL },
+};
+
+/**
+ * nvfs_parse_mount_data - parse the mount options
+ * @sbi: our superblock info, its options zeroed
+ * @options: comma separated options, or NULL
+ *
+ * pos_ttl and neg_ttl are the times, in milliseconds, for which a
+ * positive or negative dentry found valid is taken as valid without
+ * asking the lower filesystem again. fsync_group is the window, in
+ * microseconds, in which fsyncs are batched; see nvfs_gcommit.c.
+ */
+static int
+nvfs_parse_mount_data(struct nvfs_sb_info *sbi, char *options)
+{
+	int		err = 0,
+			n;
+	char		*p;
+	substring_t	args[MAX_OPT_ARGS];
+
+	ENTER;
+
+	while ((p = strsep(&options, ",")) != NULL) {
+		if (!*p)
+			continue;
+		err = -EINVAL;
+		switch (match_token(p, nvfs_tokens, args)) {
+		case Opt_pos_ttl:
+			if (match_int(&args[0], &n) || n < 0)
+				goto out;
+			sbi->wsi_pos_ttl = n;
+			break;
+		case Opt_neg_ttl:
+			if (match_int(&args[0], &n) || n < 0)
+				goto out;
+			sbi->wsi_neg_ttl = n;
+			break;
+		case Opt_fsync_group:
+			if (match_int(&args[0], &n) || n < 0)
+				goto out;
+			sbi->wsi_gc_us = n;
+			break;
+		default:
+			printk(KERN_ERR "nvfs: unknown mount option %s\n", p);
+			goto out;
+		}
+		err = 0;
+	}
+out:
+	EXIT_RET(err);
+}
+
+/* what get_sb_nodev hands nvfs_read_super */
+struct nvfs_mount_data {
+	const char	*dev_name;
+	void		*raw_data;
+};
+
 /**
  * nvfs_read_super - read our superblock
  * @sb: upper superblock
- * @dname: device name
+ * @data: device name and mount options, a struct nvfs_mount_data
  * @silent: not used
  */
 static int
-nvfs_read_super(struct super_block *sb, void *dname, int silent)
+nvfs_read_super(struct super_block *sb, void *data, int silent)
 {
 	int			err = 0;
+	struct nvfs_mount_data	*md = data;
+	char			*dname = (char *)md->dev_name;
 	struct dentry		*lower_root = NULL;
 	struct vfsmount		*lower_mount = NULL;
 	const struct qstr	name = { .name = "/", .len = 1 };
@@ -122,6 +248,15 @@ nvfs_read_super(struct super_block *sb, void *dname, int silent)
 		goto out;
 	}
 	memset(SUPERBLOCK_TO_PRIVATE(sb), 0, sizeof(struct nvfs_sb_info));
+	INIT_LIST_HEAD(&SUPERBLOCK_TO_PRIVATE(sb)->wsi_callbacks);
+	INIT_LIST_HEAD(&SUPERBLOCK_TO_PRIVATE(sb)->wsi_next);
+	atomic_set(&SUPERBLOCK_TO_PRIVATE(sb)->wsi_ev_queued, 0);
+	spin_lock_init(&SUPERBLOCK_TO_PRIVATE(sb)->wsi_gc_lock);
+	mutex_init(&SUPERBLOCK_TO_PRIVATE(sb)->wsi_gc_mutex);
+
+	err = nvfs_parse_mount_data(SUPERBLOCK_TO_PRIVATE(sb), md->raw_data);
+	if (err)
+		goto out_free;
 
 	err = nvfs_parse_options(sb, dname, &lower_root, &lower_mount);
 	if (err)
@@ -134,6 +269,10 @@ nvfs_read_super(struct super_block *sb, void *dname, int silent)
 
 	sb->s_op = &nvfs_sops;
 
+	err = nvfs_attach_sb(sb);
+	if (err)
+		goto out_dput;
+
 	sb->s_root = d_alloc(NULL, &name);
 	if (IS_ERR(sb->s_root)) {
 		printk(KERN_WARNING "nvfs_read_super: d_alloc failed\n");
@@ -141,7 +280,11 @@ nvfs_read_super(struct super_block *sb, void *dname, int silent)
 		goto out_dput;
 	}
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
 	sb->s_root->d_op = &nvfs_dops;
+#else
+	d_set_d_op(sb->s_root, &nvfs_dops);
+#endif
 	sb->s_root->d_sb = sb;
 	sb->s_root->d_parent = sb->s_root;
 
@@ -154,6 +297,7 @@ nvfs_read_super(struct super_block *sb, void *dname, int silent)
 	}
 	DENTRY_TO_LOWER(sb->s_root) = lower_root;
 	DENTRY_TO_LVFSMNT(sb->s_root) = lower_mount;
+	DENTRY_TO_PRIVATE(sb->s_root)->wdi_time = jiffies;
 
 	err = nvfs_interpose(lower_root, sb->s_root, sb, 0);
 	if (err)
@@ -167,6 +311,7 @@ out_dput:
 	dput(lower_root);
 out_free:
 	mntput(lower_mount);
+	nvfs_detach_sb(sb);
 	kfree(SUPERBLOCK_TO_PRIVATE(sb));
 	SUPERBLOCK_TO_PRIVATE_SM(sb) = NULL;
 out:
@@ -187,17 +332,18 @@ out_no_raw:
 static struct super_block *nvfs_get_sb(struct file_system_type *fs_type,
 		int flags, const char *dev_name, void *raw_data)
 {
+	struct nvfs_mount_data	md = { dev_name, raw_data };
 
-	return get_sb_nodev(fs_type, flags, dev_name, nvfs_read_super);
+	return get_sb_nodev(fs_type, flags, &md, nvfs_read_super);
 }
 #else
 static int nvfs_get_sb(struct file_system_type *fs_type,
 		int flags, const char *dev_name,
 		void *raw_data, struct vfsmount *mnt)
 {
+	struct nvfs_mount_data	md = { dev_name, raw_data };
 
-	return get_sb_nodev(fs_type, flags, (char *)dev_name,
-			nvfs_read_super, mnt);
+	return get_sb_nodev(fs_type, flags, &md, nvfs_read_super, mnt);
 }
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,18) */
 
@@ -208,6 +354,10 @@ static int nvfs_get_sb(struct file_system_type *fs_type,
 void
 nvfs_kill_block_super(struct super_block *sb)
 {
+	/* deferred events pin dentries; drain them first */
+	nvfs_coalesce_flush_sb(sb);
+	nvfs_event_flush(sb);
+	nvfs_detach_sb(sb);
 	generic_shutdown_super(sb);
 }
 
@@ -219,56 +369,588 @@ static struct file_system_type nvfs_fs_type = {
 	.fs_flags	= 0,
 };
 
+/**
+ * nvfs_hooks_get - turn the hook sites on
+ *
+ * Counted; the sites only flip on the first get and the last put. May
+ * sleep.
+ */
+void
+nvfs_hooks_get(void)
+{
+	ENTER;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+	static_branch_inc(&nvfs_hooks_key);
+#else
+	mutex_lock(&nvfs_hooks_mutex);
+	if (nvfs_hooks_users++ == 0)
+		nvfs_hooks_enabled = 1;
+	mutex_unlock(&nvfs_hooks_mutex);
+#endif
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_hooks_put - drop a reference taken by nvfs_hooks_get
+ */
+void
+nvfs_hooks_put(void)
+{
+	ENTER;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,3,0)
+	static_branch_dec(&nvfs_hooks_key);
+#else
+	mutex_lock(&nvfs_hooks_mutex);
+	if (--nvfs_hooks_users == 0)
+		nvfs_hooks_enabled = 0;
+	mutex_unlock(&nvfs_hooks_mutex);
+#endif
+	EXIT_NORET;
+}
+
+/* where each slot's member lives in its operations table */
+#define NVFS_FOP_SLOT(func) offsetof(struct file_operations, func),
+static const size_t nvfs_fop_slots[] = {
+#include "nvfs_slots.h"
+};
+#undef NVFS_FOP_SLOT
+#define NVFS_IOP_SLOT(func) offsetof(struct inode_operations, func),
+static const size_t nvfs_iop_slots[] = {
+#include "nvfs_slots.h"
+};
+#undef NVFS_IOP_SLOT
+#define NVFS_SOP_SLOT(func) offsetof(struct super_operations, func),
+static const size_t nvfs_sop_slots[] = {
+#include "nvfs_slots.h"
+};
+#undef NVFS_SOP_SLOT
+#define NVFS_DOP_SLOT(func) offsetof(struct dentry_operations, func),
+static const size_t nvfs_dop_slots[] = {
+#include "nvfs_slots.h"
+};
+#undef NVFS_DOP_SLOT
+
+#define NVFS_DISPATCH_KIND(op, slots) {					\
+	offsetof(struct nvfs_callback_info, op),			\
+	offsetof(struct nvfs_dispatch, op),				\
+	ARRAY_SIZE(slots),						\
+	slots,								\
+}
+
+/* where each table lives in a callback and in the dispatch snapshot */
+static const struct {
+	size_t		cb_off;
+	size_t		d_off;
+	size_t		nslots;
+	const size_t	*slots;
+} nvfs_dispatch_kinds[] = {
+	NVFS_DISPATCH_KIND(reg_f_op, nvfs_fop_slots),
+	NVFS_DISPATCH_KIND(reg_i_op, nvfs_iop_slots),
+	NVFS_DISPATCH_KIND(dir_i_op, nvfs_iop_slots),
+	NVFS_DISPATCH_KIND(sym_i_op, nvfs_iop_slots),
+	NVFS_DISPATCH_KIND(sb_op, nvfs_sop_slots),
+	NVFS_DISPATCH_KIND(d_op, nvfs_dop_slots),
+};
+
+#define CB_TABLE(cb, k) \
+	(*(char **)((char *)(cb) + nvfs_dispatch_kinds[k].cb_off))
+/* the function in slot @s of table @k of @cb; the table is not NULL */
+#define CB_FN(cb, k, s) \
+	(*(nvfs_fn_t *)(CB_TABLE(cb, k) + nvfs_dispatch_kinds[k].slots[s]))
+#define D_VECTORS(d, k) \
+	((struct nvfs_hook **)((char *)(d) + nvfs_dispatch_kinds[k].d_off))
+
+/*
+ * Deferred consumers only see events; their tables are never called. A
+ * consumer the watchdog found slow has its events deferred, but its
+ * tables can only be called inline, so they still are.
+ */
+#define CB_HOOKS(cb, k, s)						\
+	(!((cb)->flags & (NVFS_CB_ASYNC | NVFS_CB_SKIP)) &&		\
+		CB_TABLE(cb, k) && CB_FN(cb, k, s))
+/* whether @cb belongs on event list @l */
+#define CB_EVENTS(cb, l)						\
+	(NVFS_EV_HANDLER(cb, (l) & 2) && !((cb)->flags & NVFS_CB_SKIP) && \
+		!((cb)->flags & (NVFS_CB_ASYNC | NVFS_CB_SLOW)) == !((l) & 1))
+
+/*
+ * Every consumer that applies to the mount @sbi: those registered for
+ * all mounts, then those bound to it.
+ */
+#define for_each_sb_callback(cb, i, sbi)				\
+	for (i = 0; i < 2; i++)						\
+		list_for_each_entry(cb, i ? &(sbi)->wsi_callbacks :	\
+				&nvfs_callbacks, next)
+
+/**
+ * nvfs_dispatch_events - fill one of the event consumer lists
+ * @d: snapshot being built
+ * @sbi: mount it is for
+ * @pos: first free slot in @d
+ * @l: which list, see NVFS_EV_LIST
+ *
+ * Returns the next free slot. Called with nvfs_cb_mutex held.
+ */
+static struct nvfs_callback_info **
+nvfs_dispatch_events(struct nvfs_dispatch *d, struct nvfs_sb_info *sbi,
+		struct nvfs_callback_info **pos, int l)
+{
+	int				i;
+	struct nvfs_callback_info	**list = pos;
+	struct nvfs_callback_info	*cb;
+
+	ENTER;
+
+	for_each_sb_callback(cb, i, sbi)
+		if (CB_EVENTS(cb, l))
+			*pos++ = cb;
+	if (pos != list) {
+		*pos++ = NULL;
+		d->ev[l] = list;
+	}
+	EXIT_RET_PTR(pos);
+}
+
+/**
+ * nvfs_dispatch_build - compile the consumers of a mount into a snapshot
+ * @sbi: the mount
+ * @gfp: allocation flags
+ *
+ * Returns NULL with *@err == 0 if nothing applies to the mount. Called
+ * with nvfs_cb_mutex held.
+ */
+static struct nvfs_dispatch *
+nvfs_dispatch_build(struct nvfs_sb_info *sbi, gfp_t gfp, int *err)
+{
+	int				i,
+					k,
+					l;
+	size_t				s,
+					nfn = 0,
+					nev = 0;
+	struct nvfs_hook		*pos,
+					**vec;
+	struct nvfs_dispatch		*d = NULL;
+	struct nvfs_callback_info	*cb,
+					**evpos;
+
+	ENTER;
+
+	*err = 0;
+	if (list_empty(&nvfs_callbacks) && list_empty(&sbi->wsi_callbacks))
+		goto out;
+
+	/* one entry per hooked function, plus a terminator per slot */
+	for (k = 0; k < ARRAY_SIZE(nvfs_dispatch_kinds); k++) {
+		for (s = 0; s < nvfs_dispatch_kinds[k].nslots; s++) {
+			size_t	n = 0;
+
+			for_each_sb_callback(cb, i, sbi)
+				if (CB_HOOKS(cb, k, s))
+					n++;
+			if (n)
+				nfn += n + 1;
+		}
+	}
+	for (l = 0; l < ARRAY_SIZE(d->ev); l++) {
+		size_t	n = 0;
+
+		for_each_sb_callback(cb, i, sbi)
+			if (CB_EVENTS(cb, l))
+				n++;
+		if (n)
+			nev += n + 1;
+	}
+
+	d = kzalloc(sizeof(*d) + nfn * sizeof(struct nvfs_hook) +
+			nev * sizeof(cb), gfp);
+	if (!d) {
+		*err = -ENOMEM;
+		goto out;
+	}
+
+	pos = d->hooks;
+	for (k = 0; k < ARRAY_SIZE(nvfs_dispatch_kinds); k++) {
+		vec = D_VECTORS(d, k);
+		for (s = 0; s < nvfs_dispatch_kinds[k].nslots; s++) {
+			for_each_sb_callback(cb, i, sbi) {
+				if (!CB_HOOKS(cb, k, s))
+					continue;
+				if (!vec[s])
+					vec[s] = pos;
+				pos->fn = CB_FN(cb, k, s);
+				pos->root = cb->root;
+				pos->filter = cb->filter;
+				pos->cb = cb;
+				pos++;
+			}
+			/* zeroed, so already a terminator */
+			if (vec[s])
+				pos++;
+		}
+	}
+
+	evpos = (struct nvfs_callback_info **)pos;
+	for (l = 0; l < ARRAY_SIZE(d->ev); l++)
+		evpos = nvfs_dispatch_events(d, sbi, evpos, l);
+out:
+	EXIT_RET_PTR(d);
+}
+
+/**
+ * nvfs_dispatch_free - free a chain of replaced snapshots
+ * @stale: chain linked through ->stale
+ *
+ * Waits, once, for readers of any of them. Called with nvfs_cb_mutex
+ * held.
+ */
+static void
+nvfs_dispatch_free(struct nvfs_dispatch *stale)
+{
+	struct nvfs_dispatch	*d;
+
+	ENTER;
+
+	if (!stale)
+		goto out;
+
+	synchronize_srcu(&nvfs_cb_srcu);
+	while (stale) {
+		d = stale;
+		stale = d->stale;
+		kfree(d);
+	}
+out:
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_dispatch_rebuild - rebuild and publish dispatch snapshots
+ * @only: the mount whose consumers changed, or NULL for every mount
+ * @gfp: allocation flags
+ *
+ * Stops at the first failure, leaving the remaining mounts on their old
+ * snapshot. Called with nvfs_cb_mutex held.
+ */
+static int
+nvfs_dispatch_rebuild(struct nvfs_sb_info *only, gfp_t gfp)
+{
+	int			err = 0;
+	struct nvfs_dispatch	*d,
+				*old,
+				*stale = NULL;
+	struct nvfs_sb_info	*sbi;
+
+	ENTER;
+
+	list_for_each_entry(sbi, &nvfs_supers, wsi_next) {
+		if (only && sbi != only)
+			continue;
+		d = nvfs_dispatch_build(sbi, gfp, &err);
+		if (err)
+			break;
+		old = sbi->wsi_dispatch;
+		rcu_assign_pointer(sbi->wsi_dispatch, d);
+		if (old) {
+			old->stale = stale;
+			stale = old;
+		}
+	}
+	nvfs_dispatch_free(stale);
+
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_register - add a callback to a list and publish it
+ * @callback: callback, with ->sb and ->root already set
+ * @sbi: mount it is bound to, or NULL for all
+ * @head: whether to put it on the front or back of the list
+ */
+static int
+nvfs_register(struct nvfs_callback_info *callback, struct nvfs_sb_info *sbi,
+		int head)
+{
+	int			err = 0;
+	struct list_head	*list = sbi ? &sbi->wsi_callbacks :
+						&nvfs_callbacks;
+
+	ENTER;
+
+	err = nvfs_filter_check(callback->filter);
+	if (err)
+		goto out;
+	callback->flags &= ~(NVFS_CB_SLOW | NVFS_CB_SKIP);
+	callback->stats = nvfs_stats_alloc();
+	if (!callback->stats) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	mutex_lock(&nvfs_cb_mutex);
+	/* the mount is on its way down */
+	if (sbi && list_empty(&sbi->wsi_next)) {
+		err = -ENOENT;
+		goto out_unlock;
+	}
+
+	if (head)
+		list_add(&callback->next, list);
+	else
+		list_add_tail(&callback->next, list);
+	err = nvfs_dispatch_rebuild(sbi, GFP_KERNEL);
+	if (err) {
+		list_del_init(&callback->next);
+		nvfs_dispatch_rebuild(sbi, GFP_KERNEL | __GFP_NOFAIL);
+	} else
+		nvfs_hooks_get();
+out_unlock:
+	mutex_unlock(&nvfs_cb_mutex);
+	if (err) {
+		nvfs_stats_free(callback->stats);
+		callback->stats = NULL;
+	}
+out:
+	EXIT_RET(err);
+}
+
 /**
  * register_nvfs_callbacks - allow FS plugins to register a callback
  * @callback: callback to register
  * @head: whether to put this callback on the front or back of the list
+ *
+ * The callback applies to every nvfs mount. The operation tables are
+ * sampled here; a module that changes them afterwards must unregister
+ * and register again.
  */
 int
 register_nvfs_callback(struct nvfs_callback_info *callback, int head)
 {
-	int	err = 0;
+	int	err = -EINVAL;
 
 	ENTER;
 
 	if (callback) {
-		INIT_LIST_HEAD(&callback->next);
-		if (head)
-			list_add(&callback->next, &nvfs_callbacks);
-		else
-			list_add_tail(&callback->next, &nvfs_callbacks);
-	} else
-		err = -EINVAL;
+		callback->sb = NULL;
+		callback->root = NULL;
+		err = nvfs_register(callback, NULL, head);
+	}
 
 	EXIT_RET(err);
 }
 EXPORT_SYMBOL(register_nvfs_callback);
 
+/**
+ * register_nvfs_callback_sb - register a callback for one nvfs mount
+ * @callback: callback to register
+ * @sb: nvfs superblock, which the caller keeps mounted for the duration
+ * @head: whether to put this callback on the front or back of the list
+ *
+ * Operations on other mounts never see @callback. Callbacks for all
+ * mounts are called before those bound to one. If the mount goes away
+ * first, @callback is dropped at unmount; unregistering it afterwards is
+ * harmless.
+ */
+int
+register_nvfs_callback_sb(struct nvfs_callback_info *callback,
+		struct super_block *sb, int head)
+{
+	int	err = -EINVAL;
+
+	ENTER;
+
+	if (callback && sb && sb->s_op == &nvfs_sops) {
+		callback->sb = sb;
+		callback->root = NULL;
+		err = nvfs_register(callback, SUPERBLOCK_TO_PRIVATE(sb), head);
+	}
+
+	EXIT_RET(err);
+}
+EXPORT_SYMBOL(register_nvfs_callback_sb);
+
+/**
+ * register_nvfs_callback_subtree - register a callback for a subtree
+ * @callback: callback to register
+ * @root: nvfs dentry at the top of the subtree
+ * @head: whether to put this callback on the front or back of the list
+ *
+ * As register_nvfs_callback_sb, but @callback is only called for
+ * operations through dentries at or below @root, which is pinned until
+ * unregister or unmount.
+ */
+int
+register_nvfs_callback_subtree(struct nvfs_callback_info *callback,
+		struct dentry *root, int head)
+{
+	int	err = -EINVAL;
+
+	ENTER;
+
+	if (callback && root && root->d_sb->s_op == &nvfs_sops) {
+		callback->sb = root->d_sb;
+		callback->root = dget(root);
+		err = nvfs_register(callback,
+				SUPERBLOCK_TO_PRIVATE(root->d_sb), head);
+		if (err) {
+			dput(root);
+			callback->root = NULL;
+		}
+	}
+
+	EXIT_RET(err);
+}
+EXPORT_SYMBOL(register_nvfs_callback_subtree);
+
 /**
  * unregister_nvfs_callbacks - allow a FS plugin to unregister callback
  * @callback: callback to unregister
+ *
+ * Does not return until every reader that might still call into
+ * @callback has finished, so the caller may free it (or unload) as soon
+ * as we return.
  */
 int
 unregister_nvfs_callback(struct nvfs_callback_info *callback)
 {
 	int				err = 0;
+	struct dentry			*root = NULL;
+	struct nvfs_sb_info		*sbi = NULL;
 	struct nvfs_callback_info	*ptr;
 
 	ENTER;
 
-	if (callback) {
-		struct list_head	*tmp,
-					*safe;
-		list_for_each_safe(tmp, safe, &nvfs_callbacks) {
-			ptr = list_entry(tmp, struct nvfs_callback_info, next);
-			if (ptr == callback)
+	if (!callback)
+		goto out;
+
+	mutex_lock(&nvfs_cb_mutex);
+	if (callback->sb) {
+		/* still bound; nvfs_detach_sb clears ->sb */
+		sbi = SUPERBLOCK_TO_PRIVATE(callback->sb);
+		list_del_init(&callback->next);
+	} else {
+		list_for_each_entry(ptr, &nvfs_callbacks, next) {
+			if (ptr == callback) {
 				list_del_init(&ptr->next);
+				break;
+			}
 		}
+		if (ptr != callback)
+			goto out_unlock;
 	}
+
+	/* must not fail: @callback may be unloading */
+	nvfs_dispatch_rebuild(sbi, GFP_KERNEL | __GFP_NOFAIL);
+	nvfs_hooks_put();
+	root = callback->root;
+	callback->root = NULL;
+	callback->sb = NULL;
+	nvfs_stats_free(callback->stats);
+	callback->stats = NULL;
+out_unlock:
+	mutex_unlock(&nvfs_cb_mutex);
+	dput(root);
+out:
 	EXIT_RET(err);
 }
 EXPORT_SYMBOL(unregister_nvfs_callback);
 
+/**
+ * nvfs_attach_sb - start dispatching for a new mount
+ * @sb: nvfs superblock, with its private info set up
+ */
+int
+nvfs_attach_sb(struct super_block *sb)
+{
+	int			err;
+	struct nvfs_sb_info	*sbi = SUPERBLOCK_TO_PRIVATE(sb);
+
+	ENTER;
+
+	mutex_lock(&nvfs_cb_mutex);
+	list_add_tail(&sbi->wsi_next, &nvfs_supers);
+	err = nvfs_dispatch_rebuild(sbi, GFP_KERNEL);
+	if (err)
+		list_del_init(&sbi->wsi_next);
+	mutex_unlock(&nvfs_cb_mutex);
+
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_detach_sb - stop dispatching for a mount going away
+ * @sb: nvfs superblock
+ *
+ * Callbacks bound to the mount are dropped, and their subtree roots
+ * released so the dcache can be shrunk. Safe on a mount that was never
+ * attached.
+ */
+void
+nvfs_detach_sb(struct super_block *sb)
+{
+	struct nvfs_sb_info		*sbi = SUPERBLOCK_TO_PRIVATE(sb);
+	struct nvfs_dispatch		*d;
+	struct nvfs_callback_info	*cb,
+					*tmp;
+
+	ENTER;
+
+	if (!sbi)
+		goto out;
+
+	mutex_lock(&nvfs_cb_mutex);
+	list_del_init(&sbi->wsi_next);
+	d = sbi->wsi_dispatch;
+	rcu_assign_pointer(sbi->wsi_dispatch, NULL);
+	nvfs_dispatch_free(d);
+	list_for_each_entry_safe(cb, tmp, &sbi->wsi_callbacks, next) {
+		list_del_init(&cb->next);
+		dput(cb->root);
+		cb->root = NULL;
+		cb->sb = NULL;
+		nvfs_stats_free(cb->stats);
+		cb->stats = NULL;
+		nvfs_hooks_put();
+	}
+	mutex_unlock(&nvfs_cb_mutex);
+out:
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_callbacks_walk - call a function on every registered callback
+ * @fn: function to call, with nvfs_cb_mutex held
+ * @arg: passed to @fn
+ *
+ * Callbacks for all mounts come first, then those bound to each mount.
+ * If @fn returns nonzero for any of them, it changed how that callback
+ * is dispatched, and every snapshot is rebuilt before returning. Returns
+ * the result of that rebuild.
+ */
+int
+nvfs_callbacks_walk(int (*fn)(struct nvfs_callback_info *, void *),
+		void *arg)
+{
+	int				err = 0,
+					changed = 0;
+	struct nvfs_sb_info		*sbi;
+	struct nvfs_callback_info	*cb;
+
+	ENTER;
+
+	mutex_lock(&nvfs_cb_mutex);
+	list_for_each_entry(cb, &nvfs_callbacks, next)
+		changed |= fn(cb, arg);
+	list_for_each_entry(sbi, &nvfs_supers, wsi_next)
+		list_for_each_entry(cb, &sbi->wsi_callbacks, next)
+			changed |= fn(cb, arg);
+	if (changed)
+		err = nvfs_dispatch_rebuild(NULL, GFP_KERNEL);
+	mutex_unlock(&nvfs_cb_mutex);
+
+	EXIT_RET(err);
+}
+
 /**
  * init_nvfs_fs - initialize FS driver
  */
@@ -282,15 +964,35 @@ init_nvfs_fs(void)
 	printk(KERN_NOTICE "Registering nvfs filesystem module\n");
 
 	INIT_LIST_HEAD(&nvfs_callbacks);
-	err = nvfs_init_inodecache();
+	err = init_srcu_struct(&nvfs_cb_srcu);
 	if (err)
 		goto out1;
-	err = register_filesystem(&nvfs_fs_type);
+	err = nvfs_init_inodecache();
+	if (err)
+		goto out_srcu;
+	err = nvfs_event_init();
 	if (err)
 		goto out;
+	err = nvfs_ring_init();
+	if (err)
+		goto out_event;
+	err = nvfs_stats_init();
+	if (err)
+		goto out_ring;
+	err = register_filesystem(&nvfs_fs_type);
+	if (err)
+		goto out_stats;
 	goto out1;
+out_stats:
+	nvfs_stats_exit();
+out_ring:
+	nvfs_ring_exit();
+out_event:
+	nvfs_event_exit();
 out:
 	nvfs_destroy_inodecache();
+out_srcu:
+	cleanup_srcu_struct(&nvfs_cb_srcu);
 out1:
 	EXIT_RET(err);
 }
@@ -302,8 +1004,18 @@ static void __exit
 exit_nvfs_fs(void)
 {
 	printk(KERN_NOTICE "Unregistering nvfs filesystem module\n");
-	nvfs_destroy_inodecache();
 	unregister_filesystem(&nvfs_fs_type);
+	/*
+	 * dentry info, inodes and lookup filters freed by the last umount
+	 * go by call_rcu
+	 */
+	rcu_barrier();
+	nvfs_destroy_inodecache();
+	nvfs_coalesce_exit();
+	nvfs_stats_exit();
+	nvfs_ring_exit();
+	nvfs_event_exit();
+	cleanup_srcu_struct(&nvfs_cb_srcu);
 }
 
 MODULE_AUTHOR("Justin Banks");
@@ -0,0 +1,358 @@
+#include "nvfs.h"
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+
+/*
+ * Userspace event channel. While /dev/nvfs is open, every event is also
+ * written as a compact record into a ring belonging to the CPU it was
+ * raised on. The rings are mapped into the reader, so records are
+ * consumed without a system call or copy per event; poll() is only
+ * needed to sleep once every ring is empty. See nvfs_user.h for the
+ * layout. There is a single reader at a time.
+ */
+
+struct nvfs_ring {
+	struct nvfs_ring_header	*hdr;
+	char			*data;
+	/* our copies; hdr is writable by the reader, so only stored to */
+	u64			head;
+	u64			dropped;
+	u32			mask;
+};
+
+struct nvfs_ring **nvfs_rings;
+
+static int nvfs_ring_pages = 256;
+module_param(nvfs_ring_pages, int, 0644);
+MODULE_PARM_DESC(nvfs_ring_pages, "Data pages per CPU event ring");
+
+static DECLARE_WAIT_QUEUE_HEAD(nvfs_ring_wait);
+static unsigned long nvfs_ring_busy;
+static unsigned int nvfs_ring_map_pages;
+
+/**
+ * nvfs_ring_name - copy a dentry name into a record
+ * @dentry: dentry, or NULL
+ * @dst: where to copy it
+ * @max: space reserved for it
+ *
+ * The name may have changed since space was reserved; copy what fits.
+ */
+static unsigned int
+nvfs_ring_name(struct dentry *dentry, char *dst, unsigned int max)
+{
+	unsigned int	len = 0;
+
+	ENTER;
+
+	if (!dentry)
+		goto out;
+
+	spin_lock(&dentry->d_lock);
+	len = MIN(dentry->d_name.len, max);
+	memcpy(dst, dentry->d_name.name, len);
+	spin_unlock(&dentry->d_lock);
+out:
+	EXIT_RET(len);
+}
+
+static inline unsigned int
+nvfs_ring_name_len(struct dentry *dentry)
+{
+	return dentry ? MIN(ACCESS_ONCE(dentry->d_name.len), 255) : 0;
+}
+
+/**
+ * nvfs_ring_write - append a record for an event to this CPU's ring
+ * @ev: event
+ *
+ * Called from nvfs_event_notify under nvfs_cb_srcu. If the ring is full
+ * the record is dropped and counted in the header. Interrupts are off
+ * while the record is written, so nothing else on this CPU can start one
+ * in the middle of it.
+ */
+void
+nvfs_ring_write(const struct nvfs_event *ev)
+{
+	unsigned long			flags;
+	u64				head,
+					used;
+	unsigned int			nl,
+					nl2,
+					need,
+					off,
+					room;
+	struct nvfs_ring		**rings;
+	struct nvfs_ring		*ring;
+	struct nvfs_ring_record		*rec;
+
+	ENTER;
+
+	rings = srcu_dereference(nvfs_rings, &nvfs_cb_srcu);
+	if (!rings)
+		goto out;
+
+	nl = nvfs_ring_name_len(ev->dentry);
+	nl2 = nvfs_ring_name_len(ev->dentry2);
+	need = ALIGN(sizeof(*rec) + nl + nl2, 8);
+
+	local_irq_save(flags);
+	ring = rings[smp_processor_id()];
+	head = ring->head;
+	/* tail is the reader's to write; clamp it to [head - size, head] */
+	used = head - ACCESS_ONCE(ring->hdr->tail);
+	if ((s64)used < 0)
+		used = 0;
+	else if (used > ring->mask + 1)
+		used = ring->mask + 1;
+	/* don't write over records until the reader is done with them */
+	smp_mb();
+
+	off = head & ring->mask;
+	room = ring->mask + 1 - off;
+	if (room >= need)
+		room = 0;
+	if (used + room + need > ring->mask + 1) {
+		ACCESS_ONCE(ring->hdr->dropped) = ++ring->dropped;
+		goto out_put;
+	}
+
+	if (room) {
+		rec = (struct nvfs_ring_record *)(ring->data + off);
+		rec->size = room;
+		rec->op = NVFS_OP_none;
+		head += room;
+		off = 0;
+	}
+
+	rec = (struct nvfs_ring_record *)(ring->data + off);
+	rec->size = need;
+	rec->op = ev->op;
+	rec->flags = ev->flags;
+	rec->dev = ev->inode ? new_encode_dev(ev->inode->i_sb->s_dev) : 0;
+	rec->mode = ev->mode;
+	rec->ino = ev->inode ? ev->inode->i_ino : 0;
+	rec->dentry_ino = (ev->dentry && ev->dentry->d_inode) ?
+		ev->dentry->d_inode->i_ino : 0;
+	rec->offset = ev->offset;
+	rec->count = ev->count;
+	rec->offset2 = ev->offset2;
+	rec->result = ev->result;
+	if ((ev->flags & NVFS_EVF_POST) && ev->inode) {
+		rec->isize = i_size_read(ev->inode);
+		rec->mtime = ev->inode->i_mtime.tv_sec;
+		rec->mtime_nsec = ev->inode->i_mtime.tv_nsec;
+	} else {
+		rec->isize = 0;
+		rec->mtime = 0;
+		rec->mtime_nsec = 0;
+	}
+	rec->name_len = nvfs_ring_name(ev->dentry, (char *)(rec + 1), nl);
+	rec->name2_len = nvfs_ring_name(ev->dentry2,
+			(char *)(rec + 1) + rec->name_len, nl2);
+
+	/* the record must be visible before the head that covers it */
+	smp_wmb();
+	ring->head = head + need;
+	ring->hdr->head = ring->head;
+
+	smp_mb();
+	if (waitqueue_active(&nvfs_ring_wait))
+		wake_up_interruptible(&nvfs_ring_wait);
+out_put:
+	local_irq_restore(flags);
+out:
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_ring_free - free a set of rings
+ * @rings: per CPU array from nvfs_ring_alloc
+ */
+static void
+nvfs_ring_free(struct nvfs_ring **rings)
+{
+	int	cpu;
+
+	ENTER;
+
+	for_each_possible_cpu(cpu) {
+		if (!rings[cpu])
+			continue;
+		vfree(rings[cpu]->hdr);
+		kfree(rings[cpu]);
+	}
+	kfree(rings);
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_ring_alloc - allocate a ring for each possible CPU
+ * @pages: data pages per ring, a power of two
+ */
+static struct nvfs_ring **
+nvfs_ring_alloc(unsigned int pages)
+{
+	int			cpu;
+	struct nvfs_ring	**rings;
+	struct nvfs_ring	*ring;
+
+	ENTER;
+
+	rings = kcalloc(nr_cpu_ids, sizeof(*rings), GFP_KERNEL);
+	if (!rings)
+		goto out;
+
+	for_each_possible_cpu(cpu) {
+		ring = kzalloc_node(sizeof(*ring), GFP_KERNEL,
+				cpu_to_node(cpu));
+		if (!ring)
+			goto out_free;
+		rings[cpu] = ring;
+
+		/* vmalloc_user hands back zeroed, mappable memory */
+		ring->hdr = vmalloc_user((pages + 1) << PAGE_SHIFT);
+		if (!ring->hdr)
+			goto out_free;
+		ring->data = (char *)ring->hdr + PAGE_SIZE;
+		ring->mask = (pages << PAGE_SHIFT) - 1;
+		ring->hdr->version = NVFS_RING_VERSION;
+		ring->hdr->size = pages << PAGE_SHIFT;
+	}
+	goto out;
+
+out_free:
+	nvfs_ring_free(rings);
+	rings = NULL;
+out:
+	EXIT_RET_PTR(rings);
+}
+
+static int
+nvfs_ring_open(struct inode *inode, struct file *file)
+{
+	int			err = 0;
+	unsigned int		pages;
+	struct nvfs_ring	**rings;
+
+	ENTER;
+
+	if (test_and_set_bit(0, &nvfs_ring_busy)) {
+		err = -EBUSY;
+		goto out;
+	}
+
+	pages = roundup_pow_of_two(MAX(nvfs_ring_pages, 1));
+	rings = nvfs_ring_alloc(pages);
+	if (!rings) {
+		clear_bit(0, &nvfs_ring_busy);
+		err = -ENOMEM;
+		goto out;
+	}
+
+	nvfs_ring_map_pages = pages + 1;
+	file->private_data = rings;
+
+	nvfs_hooks_get();
+	rcu_assign_pointer(nvfs_rings, rings);
+out:
+	EXIT_RET(err);
+}
+
+static int
+nvfs_ring_release(struct inode *inode, struct file *file)
+{
+	ENTER;
+
+	rcu_assign_pointer(nvfs_rings, NULL);
+	/* nvfs_ring_write runs under the callback SRCU */
+	synchronize_srcu(&nvfs_cb_srcu);
+	nvfs_hooks_put();
+
+	nvfs_ring_free(file->private_data);
+	clear_bit(0, &nvfs_ring_busy);
+
+	EXIT_RET(0);
+}
+
+static int
+nvfs_ring_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int			err = -EINVAL;
+	unsigned long		cpu;
+	struct nvfs_ring	**rings = file->private_data;
+
+	ENTER;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		goto out;
+	if (vma->vm_end - vma->vm_start !=
+			(unsigned long)nvfs_ring_map_pages << PAGE_SHIFT)
+		goto out;
+	if (vma->vm_pgoff % nvfs_ring_map_pages)
+		goto out;
+
+	cpu = vma->vm_pgoff / nvfs_ring_map_pages;
+	if (cpu >= nr_cpu_ids || !cpu_possible(cpu))
+		goto out;
+
+	err = remap_vmalloc_range(vma, rings[cpu]->hdr, 0);
+out:
+	EXIT_RET(err);
+}
+
+static unsigned int
+nvfs_ring_poll(struct file *file, poll_table *wait)
+{
+	int			cpu;
+	unsigned int		mask = 0;
+	struct nvfs_ring	**rings = file->private_data;
+
+	ENTER;
+
+	poll_wait(file, &nvfs_ring_wait, wait);
+
+	for_each_possible_cpu(cpu) {
+		if (ACCESS_ONCE(rings[cpu]->hdr->tail) !=
+				ACCESS_ONCE(rings[cpu]->head)) {
+			mask = POLLIN | POLLRDNORM;
+			break;
+		}
+	}
+
+	EXIT_RET(mask);
+}
+
+static struct file_operations nvfs_ring_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nvfs_ring_open,
+	.mmap		= nvfs_ring_mmap,
+	.poll		= nvfs_ring_poll,
+	.release	= nvfs_ring_release,
+};
+
+static struct miscdevice nvfs_ring_dev = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= "nvfs",
+	.fops		= &nvfs_ring_fops,
+};
+
+int
+nvfs_ring_init(void)
+{
+	int	err;
+
+	ENTER;
+	err = misc_register(&nvfs_ring_dev);
+	EXIT_RET(err);
+}
+
+void
+nvfs_ring_exit(void)
+{
+	ENTER;
+	misc_deregister(&nvfs_ring_dev);
+	EXIT_NORET;
+}
@@ -0,0 +1,85 @@
+/*
+ * The operations a module can hook, one line per member of each table
+ * in nvfs_callback_info. nvfs.h includes this with NVFS_*_SLOT defined
+ * to number the slots, nvfs_main.c to record where each member lives.
+ * A member only called on some kernels is listed under the same test as
+ * its call.
+ */
+
+#ifdef NVFS_FOP_SLOT
+NVFS_FOP_SLOT(llseek)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+NVFS_FOP_SLOT(read)
+NVFS_FOP_SLOT(write)
+#else
+NVFS_FOP_SLOT(read_iter)
+NVFS_FOP_SLOT(write_iter)
+#endif
+NVFS_FOP_SLOT(readdir)
+NVFS_FOP_SLOT(poll)
+NVFS_FOP_SLOT(ioctl)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+NVFS_FOP_SLOT(fallocate)
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,19,0)
+NVFS_FOP_SLOT(fadvise)
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,5,0)
+NVFS_FOP_SLOT(copy_file_range)
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,20,0)
+NVFS_FOP_SLOT(remap_file_range)
+#endif
+NVFS_FOP_SLOT(mmap)
+NVFS_FOP_SLOT(open)
+NVFS_FOP_SLOT(flush)
+NVFS_FOP_SLOT(release)
+NVFS_FOP_SLOT(fsync)
+NVFS_FOP_SLOT(fasync)
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+NVFS_FOP_SLOT(sendfile)
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,17)
+NVFS_FOP_SLOT(splice_read)
+NVFS_FOP_SLOT(splice_write)
+#endif
+#endif /* NVFS_FOP_SLOT */
+
+#ifdef NVFS_IOP_SLOT
+NVFS_IOP_SLOT(create)
+NVFS_IOP_SLOT(lookup)
+NVFS_IOP_SLOT(link)
+NVFS_IOP_SLOT(unlink)
+NVFS_IOP_SLOT(symlink)
+NVFS_IOP_SLOT(mkdir)
+NVFS_IOP_SLOT(rmdir)
+NVFS_IOP_SLOT(mknod)
+NVFS_IOP_SLOT(rename)
+NVFS_IOP_SLOT(readlink)
+NVFS_IOP_SLOT(permission)
+NVFS_IOP_SLOT(setattr)
+NVFS_IOP_SLOT(getxattr)
+NVFS_IOP_SLOT(setxattr)
+NVFS_IOP_SLOT(removexattr)
+NVFS_IOP_SLOT(listxattr)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,28)
+NVFS_IOP_SLOT(fiemap)
+#endif
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,23) && \
+	LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
+NVFS_IOP_SLOT(fallocate)
+#endif
+#endif /* NVFS_IOP_SLOT */
+
+#ifdef NVFS_SOP_SLOT
+NVFS_SOP_SLOT(statfs)
+NVFS_SOP_SLOT(umount_begin)
+#endif /* NVFS_SOP_SLOT */
+
+#ifdef NVFS_DOP_SLOT
+NVFS_DOP_SLOT(d_revalidate)
+NVFS_DOP_SLOT(d_hash)
+NVFS_DOP_SLOT(d_compare)
+NVFS_DOP_SLOT(d_delete)
+NVFS_DOP_SLOT(d_release)
+#endif /* NVFS_DOP_SLOT */
@@ -0,0 +1,410 @@
+#include "nvfs.h"
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+
+/*
+ * Consumer accounting. Every call into a consumer, raw callback or event
+ * handler, is timed and counted per CPU in a histogram for its
+ * operation, so a slow mount can be traced to the module making it slow.
+ * The totals are in /sys/kernel/debug/nvfs/stats.
+ *
+ * With nvfs_hook_budget_us set, a watchdog looks once a second at the
+ * calls each consumer took since its last look. A consumer whose 99th
+ * percentile is over budget is reported, and depending on
+ * nvfs_watchdog_action has its events deferred as if it had registered
+ * with NVFS_CB_ASYNC, or is no longer called at all. Only consumers
+ * still called inline are judged.
+ */
+
+static int nvfs_hook_budget_us = 0;
+module_param(nvfs_hook_budget_us, int, 0644);
+MODULE_PARM_DESC(nvfs_hook_budget_us,
+		"p99 time a consumer may take per call (0 disables)");
+
+static int nvfs_watchdog_action = 0;
+module_param(nvfs_watchdog_action, int, 0644);
+MODULE_PARM_DESC(nvfs_watchdog_action,
+		"Over budget: 0 warn, 1 defer its events, 2 stop calling it");
+
+/* calls needed in a window before its p99 means anything */
+#define NVFS_WATCHDOG_MIN	100
+
+static struct dentry	*nvfs_debugfs_dir;
+static struct dentry	*nvfs_debugfs_stats;
+static int		nvfs_watchdog_stop;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void nvfs_watchdog_work(void *data);
+static DECLARE_WORK(nvfs_watchdog_dwork, nvfs_watchdog_work, NULL);
+#else
+static void nvfs_watchdog_work(struct work_struct *work);
+static DECLARE_DELAYED_WORK(nvfs_watchdog_dwork, nvfs_watchdog_work);
+#endif
+
+#define NVFS_OP_NAME(op) [NVFS_OP_##op] = #op
+
+static const char *nvfs_op_names[NVFS_OP_MAX] = {
+	NVFS_OP_NAME(llseek),
+	NVFS_OP_NAME(read),
+	NVFS_OP_NAME(write),
+	NVFS_OP_NAME(readdir),
+	NVFS_OP_NAME(poll),
+	NVFS_OP_NAME(ioctl),
+	NVFS_OP_NAME(mmap),
+	NVFS_OP_NAME(open),
+	NVFS_OP_NAME(flush),
+	NVFS_OP_NAME(release),
+	NVFS_OP_NAME(fsync),
+	NVFS_OP_NAME(fasync),
+	NVFS_OP_NAME(sendfile),
+	NVFS_OP_NAME(create),
+	NVFS_OP_NAME(lookup),
+	NVFS_OP_NAME(link),
+	NVFS_OP_NAME(unlink),
+	NVFS_OP_NAME(symlink),
+	NVFS_OP_NAME(mkdir),
+	NVFS_OP_NAME(rmdir),
+	NVFS_OP_NAME(mknod),
+	NVFS_OP_NAME(rename),
+	NVFS_OP_NAME(readlink),
+	NVFS_OP_NAME(permission),
+	NVFS_OP_NAME(setattr),
+	NVFS_OP_NAME(getxattr),
+	NVFS_OP_NAME(setxattr),
+	NVFS_OP_NAME(removexattr),
+	NVFS_OP_NAME(listxattr),
+	NVFS_OP_NAME(d_revalidate),
+	NVFS_OP_NAME(d_hash),
+	NVFS_OP_NAME(d_compare),
+	NVFS_OP_NAME(d_delete),
+	NVFS_OP_NAME(d_release),
+	NVFS_OP_NAME(statfs),
+	NVFS_OP_NAME(umount_begin),
+	NVFS_OP_NAME(splice_read),
+	NVFS_OP_NAME(splice_write),
+	NVFS_OP_NAME(read_iter),
+	NVFS_OP_NAME(write_iter),
+	NVFS_OP_NAME(page_mkwrite),
+	NVFS_OP_NAME(fiemap),
+	NVFS_OP_NAME(fallocate),
+	NVFS_OP_NAME(fadvise),
+	NVFS_OP_NAME(copy_file_range),
+	NVFS_OP_NAME(remap_file_range),
+};
+
+/**
+ * nvfs_stats_alloc - allocate the counters for a callback
+ */
+struct nvfs_cb_stats *
+nvfs_stats_alloc(void)
+{
+	struct nvfs_cb_stats	*stats;
+
+	ENTER;
+
+	stats = kzalloc(sizeof(*stats), GFP_KERNEL);
+	if (!stats)
+		goto out;
+	stats->pcpu = alloc_percpu(struct nvfs_cb_pcpu);
+	if (!stats->pcpu) {
+		kfree(stats);
+		stats = NULL;
+	}
+out:
+	EXIT_RET_PTR(stats);
+}
+
+/**
+ * nvfs_stats_free - free the counters of a callback
+ * @stats: from nvfs_stats_alloc, or NULL
+ *
+ * The callback must no longer be reachable from any snapshot.
+ */
+void
+nvfs_stats_free(struct nvfs_cb_stats *stats)
+{
+	ENTER;
+
+	if (stats) {
+		free_percpu(stats->pcpu);
+		kfree(stats);
+	}
+
+	EXIT_NORET;
+}
+
+static inline unsigned int
+nvfs_stats_bucket(u64 ns)
+{
+	return MIN(fls64(ns >> 8), NVFS_HIST_BUCKETS - 1);
+}
+
+/**
+ * nvfs_stats_account - count a finished call into a consumer
+ * @cb: consumer called
+ * @op: NVFS_OP_* it was called for
+ * @start: nvfs_stats_clock() before the call
+ */
+void
+nvfs_stats_account(struct nvfs_callback_info *cb, unsigned int op, u64 start)
+{
+	u64			ns = nvfs_stats_clock() - start;
+	struct nvfs_cb_pcpu	*pc;
+
+	ENTER;
+
+	pc = per_cpu_ptr(cb->stats->pcpu, get_cpu());
+	pc->hist[op][nvfs_stats_bucket(ns)]++;
+	pc->ns[op] += ns;
+	put_cpu();
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_stats_sum - add up the counters of every CPU
+ * @stats: counters of a callback
+ * @op: NVFS_OP_* to add up, or NVFS_OP_none for all of them
+ * @hist: NVFS_HIST_BUCKETS counts to fill in
+ *
+ * Returns the total time spent. Counters are read while they may be
+ * changing, which only makes the result a little stale.
+ */
+static u64
+nvfs_stats_sum(struct nvfs_cb_stats *stats, unsigned int op, u64 *hist)
+{
+	int			cpu;
+	unsigned int		o,
+				b;
+	u64			ns = 0;
+	struct nvfs_cb_pcpu	*pc;
+
+	ENTER;
+
+	memset(hist, 0, NVFS_HIST_BUCKETS * sizeof(*hist));
+	for_each_possible_cpu(cpu) {
+		pc = per_cpu_ptr(stats->pcpu, cpu);
+		for (o = 0; o < NVFS_OP_MAX; o++) {
+			if (op != NVFS_OP_none && o != op)
+				continue;
+			for (b = 0; b < NVFS_HIST_BUCKETS; b++)
+				hist[b] += pc->hist[o][b];
+			ns += pc->ns[o];
+		}
+	}
+
+	EXIT_RET(ns);
+}
+
+/**
+ * nvfs_stats_quantile - bound a percentile of a histogram
+ * @hist: NVFS_HIST_BUCKETS counts
+ * @n: their total, nonzero
+ * @pct: percentile
+ *
+ * Returns the upper bound in ns of the bucket the percentile falls in.
+ */
+static u64
+nvfs_stats_quantile(const u64 *hist, u64 n, unsigned int pct)
+{
+	unsigned int	b;
+	u64		cum = 0;
+
+	ENTER;
+
+	for (b = 0; b < NVFS_HIST_BUCKETS - 1; b++) {
+		cum += hist[b];
+		if (cum * 100 >= n * pct)
+			break;
+	}
+
+	EXIT_RET(256ULL << b);
+}
+
+/**
+ * nvfs_watchdog_check - judge the calls a consumer took since last time
+ * @cb: consumer, with nvfs_cb_mutex held
+ * @arg: unused
+ *
+ * Returns nonzero if @cb is to be dispatched differently from now on.
+ */
+static int
+nvfs_watchdog_check(struct nvfs_callback_info *cb, void *arg)
+{
+	int		changed = 0;
+	unsigned int	b;
+	u64		hist[NVFS_HIST_BUCKETS],
+			n = 0,
+			p99;
+
+	ENTER;
+
+	nvfs_stats_sum(cb->stats, NVFS_OP_none, hist);
+	for (b = 0; b < NVFS_HIST_BUCKETS; b++) {
+		hist[b] -= cb->stats->seen[b];
+		cb->stats->seen[b] += hist[b];
+		n += hist[b];
+	}
+
+	if (nvfs_hook_budget_us <= 0 || n < NVFS_WATCHDOG_MIN)
+		goto out;
+	if (cb->flags & (NVFS_CB_ASYNC | NVFS_CB_SLOW | NVFS_CB_SKIP))
+		goto out;
+	p99 = nvfs_stats_quantile(hist, n, 99);
+	if (p99 <= (u64)nvfs_hook_budget_us * 1000)
+		goto out;
+
+	if (printk_ratelimit())
+		printk(KERN_WARNING "nvfs: consumer %s over budget, "
+				"p99 under %lluns over %llu calls\n",
+				cb->name ? cb->name : "(unnamed)",
+				(unsigned long long)p99,
+				(unsigned long long)n);
+
+	if (nvfs_watchdog_action == 1 && (cb->event || cb->post)) {
+		cb->flags |= NVFS_CB_SLOW;
+		changed = 1;
+	} else if (nvfs_watchdog_action == 2) {
+		cb->flags |= NVFS_CB_SKIP;
+		changed = 1;
+	}
+out:
+	EXIT_RET(changed);
+}
+
+/**
+ * nvfs_watchdog_work - look for consumers over budget, once a second
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20)
+static void
+nvfs_watchdog_work(void *data)
+#else
+static void
+nvfs_watchdog_work(struct work_struct *work)
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,20) */
+{
+	ENTER;
+
+	nvfs_callbacks_walk(nvfs_watchdog_check, NULL);
+	if (!ACCESS_ONCE(nvfs_watchdog_stop))
+		schedule_delayed_work(&nvfs_watchdog_dwork, HZ);
+
+	EXIT_NORET;
+}
+
+/**
+ * nvfs_stats_show_cb - print the counters of one consumer
+ * @cb: consumer, with nvfs_cb_mutex held
+ * @arg: seq_file
+ */
+static int
+nvfs_stats_show_cb(struct nvfs_callback_info *cb, void *arg)
+{
+	unsigned int	op,
+			b;
+	u64		hist[NVFS_HIST_BUCKETS],
+			n,
+			ns;
+	struct seq_file	*m = arg;
+
+	ENTER;
+
+	if (cb->name)
+		seq_printf(m, "%s", cb->name);
+	else
+		seq_printf(m, "%p", cb);
+	seq_printf(m, "%s%s%s\n",
+			(cb->flags & NVFS_CB_ASYNC) ? " async" : "",
+			(cb->flags & NVFS_CB_SLOW) ? " slow" : "",
+			(cb->flags & NVFS_CB_SKIP) ? " skip" : "");
+
+	for (op = NVFS_OP_none + 1; op < NVFS_OP_MAX; op++) {
+		ns = nvfs_stats_sum(cb->stats, op, hist);
+		for (n = 0, b = 0; b < NVFS_HIST_BUCKETS; b++)
+			n += hist[b];
+		if (!n)
+			continue;
+
+		if (nvfs_op_names[op])
+			seq_printf(m, "  %-14s", nvfs_op_names[op]);
+		else
+			seq_printf(m, "  %-14u", op);
+		seq_printf(m, " %llu %llu %llu %llu",
+				(unsigned long long)n,
+				(unsigned long long)ns,
+				(unsigned long long)
+					nvfs_stats_quantile(hist, n, 50),
+				(unsigned long long)
+					nvfs_stats_quantile(hist, n, 99));
+		for (b = 0; b < NVFS_HIST_BUCKETS; b++)
+			seq_printf(m, " %llu", (unsigned long long)hist[b]);
+		seq_putc(m, '\n');
+	}
+
+	EXIT_RET(0);
+}
+
+static int
+nvfs_stats_show(struct seq_file *m, void *v)
+{
+	ENTER;
+	seq_printf(m, "# op calls ns p50 p99 histogram\n");
+	nvfs_callbacks_walk(nvfs_stats_show_cb, m);
+	EXIT_RET(0);
+}
+
+static int
+nvfs_stats_open(struct inode *inode, struct file *file)
+{
+	int	err;
+
+	ENTER;
+	err = single_open(file, nvfs_stats_show, NULL);
+	EXIT_RET(err);
+}
+
+static struct file_operations nvfs_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= nvfs_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/**
+ * nvfs_stats_init - create the debugfs file and start the watchdog
+ *
+ * Without debugfs the counters are still kept for the watchdog.
+ */
+int
+nvfs_stats_init(void)
+{
+	ENTER;
+
+	nvfs_debugfs_dir = debugfs_create_dir("nvfs", NULL);
+	if (nvfs_debugfs_dir && !IS_ERR(nvfs_debugfs_dir))
+		nvfs_debugfs_stats = debugfs_create_file("stats", 0444,
+				nvfs_debugfs_dir, NULL, &nvfs_stats_fops);
+	schedule_delayed_work(&nvfs_watchdog_dwork, HZ);
+
+	EXIT_RET(0);
+}
+
+/**
+ * nvfs_stats_exit - remove the debugfs file and stop the watchdog
+ */
+void
+nvfs_stats_exit(void)
+{
+	ENTER;
+
+	nvfs_watchdog_stop = 1;
+	cancel_delayed_work(&nvfs_watchdog_dwork);
+	flush_scheduled_work();
+	/* it may have queued itself again before seeing the flag */
+	cancel_delayed_work(&nvfs_watchdog_dwork);
+	debugfs_remove(nvfs_debugfs_stats);
+	debugfs_remove(nvfs_debugfs_dir);
+
+	EXIT_NORET;
+}
@@ -2,16 +2,7 @@
 
 struct kmem_cache *nvfs_inode_cachep;
 
-#define S_CB(func, ...) do {						\
-	struct nvfs_callback_info	*cb;				\
-	struct list_head		*tmp,				\
-					*safe;				\
-	list_for_each_safe(tmp, safe, &nvfs_callbacks) {		\
-		cb = list_entry(tmp, struct nvfs_callback_info, next);	\
-		if (cb && cb->sb_op && cb->sb_op->func)			\
-			cb->sb_op->func(__VA_ARGS__);			\
-	}								\
-} while (0)
+#define S_CB(sb, func, ...) NVFS_CB(sb, NULL, sb_op, func, __VA_ARGS__)
 
 static void
 nvfs_read_inode(struct inode *inode)
@@ -27,6 +18,7 @@ nvfs_read_inode(struct inode *inode)
 	inode->i_fop = &nvfs_main_fops;
 
 	inode->i_sb->s_type->fs_flags |= FS_REQUIRES_DEV;
+	/* nvfs_iget gives regular files nvfs_aops */
 	inode->i_mapping->a_ops = &nvfs_empty_aops;
 
 	EXIT_NORET;
@@ -78,12 +70,13 @@ nvfs_statfs(struct super_block *sb, struct kstatfs *buf)
 nvfs_statfs(struct dentry *dentry, struct kstatfs *buf)
 {
 	int			err = 0;
+	struct super_block	*sb = dentry->d_sb;
 	struct dentry		*lower = DENTRY_TO_LOWER(dentry);
 #endif /* LINUX_VERSION_CODE < KERNEL_VERSION(2,6,16) */
 
 	ENTER;
 
-	S_CB(statfs, lower, buf);
+	S_CB(sb, statfs, lower, buf);
 
 	err = vfs_statfs(lower, buf);
 
@@ -104,6 +97,9 @@ nvfs_clear_inode(struct inode *inode)
 {
 
 	ENTER;
+	nvfs_coalesce_flush(inode);
+	nvfs_dirty_free(inode);
+	nvfs_bloom_free(inode);
 	iput(INODE_TO_LOWER(inode));
 	EXIT_NORET;
 }
@@ -118,7 +114,7 @@ nvfs_umount_begin(struct super_block *sb)
 
 	lower_sb = SUPERBLOCK_TO_LOWER(sb);
 
-	S_CB(umount_begin, lower_sb);
+	S_CB(sb, umount_begin, lower_sb);
 
 	if (lower_sb->s_op->umount_begin)
 		lower_sb->s_op->umount_begin(lower_sb);
@@ -139,7 +135,7 @@ nvfs_umount_begin(struct vfsmount *vfsmnt, int flags)
 	lower_sb = SUPERBLOCK_TO_LOWER(sb);
 	lower_vfsmnt = DENTRY_TO_LVFSMNT(sb->s_root);
 
-	S_CB(umount_begin, lower_vfsmnt, flags);
+	S_CB(sb, umount_begin, lower_vfsmnt, flags);
 
 	if (lower_sb->s_op->umount_begin)
 		lower_sb->s_op->umount_begin(lower_vfsmnt, flags);
@@ -149,10 +145,27 @@ nvfs_umount_begin(struct vfsmount *vfsmnt, int flags)
 #endif /* LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,18) */
 
 /* Called to print options in /proc/mounts */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0)
 static int
 nvfs_show_options(struct seq_file *m, struct vfsmount *mnt)
+#else
+static int
+nvfs_show_options(struct seq_file *m, struct dentry *root)
+#endif
 {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3,3,0)
+	struct nvfs_sb_info	*sbi = SUPERBLOCK_TO_PRIVATE(mnt->mnt_sb);
+#else
+	struct nvfs_sb_info	*sbi = SUPERBLOCK_TO_PRIVATE(root->d_sb);
+#endif
+
 	ENTER;
+	if (sbi->wsi_pos_ttl)
+		seq_printf(m, ",pos_ttl=%u", sbi->wsi_pos_ttl);
+	if (sbi->wsi_neg_ttl)
+		seq_printf(m, ",neg_ttl=%u", sbi->wsi_neg_ttl);
+	if (sbi->wsi_gc_us)
+		seq_printf(m, ",fsync_group=%u", sbi->wsi_gc_us);
 	EXIT_RET(0);
 }
 
@@ -172,15 +185,37 @@ nvfs_alloc_inode(struct super_block *sb)
 	if (!wi)
 		return NULL;
 	wi->vfs_inode.i_version = 1;
+	wi->wii_inode = NULL;
+	wi->wii_dirty = RB_ROOT;
+	wi->wii_ndirty = 0;
+	wi->wii_dflags = NVFS_DIRTY_UNKNOWN;
+	wi->wii_dsize = 0;
+	wi->wii_bloom = NULL;
+	wi->wii_bmisses = 0;
+
+	EXIT_RET_PTR(&wi->vfs_inode);
+}
 
-	EXIT_RET(&wi->vfs_inode);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,38)
+static void
+nvfs_i_callback(struct rcu_head *head)
+{
+	struct inode	*inode = container_of(head, struct inode, i_rcu);
+
+	kmem_cache_free(nvfs_inode_cachep, NVFS_I(inode));
 }
+#endif
 
 static void
 nvfs_destroy_inode(struct inode *inode)
 {
 	ENTER;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(2,6,38)
 	kmem_cache_free(nvfs_inode_cachep, NVFS_I(inode));
+#else
+	/* RCU-walk may still be reading it, its filter among others */
+	call_rcu(&inode->i_rcu, nvfs_i_callback);
+#endif
 	EXIT_NORET;
 }
 
@@ -195,6 +230,11 @@ init_once(void *foo)
 
 	ENTER;
 	inode_init_once(&wi->vfs_inode);
+	spin_lock_init(&wi->wii_lock);
+	wi->wii_wdentry = NULL;
+	INIT_LIST_HEAD(&wi->wii_wlist);
+	mutex_init(&wi->wii_wc_mutex);
+	INIT_LIST_HEAD(&wi->wii_wcombine);
 	EXIT_NORET;
 }
 
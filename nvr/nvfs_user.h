@@ -0,0 +1,154 @@
+#ifndef __NVFS_USER_H_
+#define __NVFS_USER_H_
+
+/*
+ * Definitions shared with userspace. Keep this free of kernel-only
+ * headers.
+ */
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Operation codes, one per hooked operation, named after the member of
+ * the operations table that is hooked. New codes are only ever added at
+ * the end.
+ */
+enum nvfs_op {
+	NVFS_OP_none		= 0,
+	NVFS_OP_llseek		= 1,
+	NVFS_OP_read		= 2,
+	NVFS_OP_write		= 3,
+	NVFS_OP_readdir		= 4,
+	NVFS_OP_poll		= 5,
+	NVFS_OP_ioctl		= 6,
+	NVFS_OP_mmap		= 7,
+	NVFS_OP_open		= 8,
+	NVFS_OP_flush		= 9,
+	NVFS_OP_release		= 10,
+	NVFS_OP_fsync		= 11,
+	NVFS_OP_fasync		= 12,
+	NVFS_OP_sendfile	= 13,
+	NVFS_OP_create		= 14,
+	NVFS_OP_lookup		= 15,
+	NVFS_OP_link		= 16,
+	NVFS_OP_unlink		= 17,
+	NVFS_OP_symlink		= 18,
+	NVFS_OP_mkdir		= 19,
+	NVFS_OP_rmdir		= 20,
+	NVFS_OP_mknod		= 21,
+	NVFS_OP_rename		= 22,
+	NVFS_OP_readlink	= 23,
+	NVFS_OP_permission	= 24,
+	NVFS_OP_setattr		= 25,
+	NVFS_OP_getxattr	= 26,
+	NVFS_OP_setxattr	= 27,
+	NVFS_OP_removexattr	= 28,
+	NVFS_OP_listxattr	= 29,
+	NVFS_OP_d_revalidate	= 30,
+	NVFS_OP_d_hash		= 31,
+	NVFS_OP_d_compare	= 32,
+	NVFS_OP_d_delete	= 33,
+	NVFS_OP_d_release	= 34,
+	NVFS_OP_statfs		= 35,
+	NVFS_OP_umount_begin	= 36,
+	NVFS_OP_splice_read	= 37,
+	NVFS_OP_splice_write	= 38,
+	NVFS_OP_read_iter	= 39,
+	NVFS_OP_write_iter	= 40,
+	NVFS_OP_page_mkwrite	= 41,
+	NVFS_OP_fiemap		= 42,
+	NVFS_OP_fallocate	= 43,
+	NVFS_OP_fadvise		= 44,
+	NVFS_OP_copy_file_range	= 45,
+	NVFS_OP_remap_file_range = 46,
+	NVFS_OP_MAX
+};
+
+/* event and record flags */
+#define NVFS_EVF_COALESCED	0x0001	/* write range merged from several */
+#define NVFS_EVF_POST		0x0002	/* raised after the op returned */
+#define NVFS_EVF_DIRECT		0x0004	/* O_DIRECT read or write */
+
+/*
+ * Event ring, one per possible CPU, read through /dev/nvfs. Each ring is
+ * one header page followed by nvfs_ring_pages data pages (the module
+ * parameter as it was when the device was opened); ring N is mapped by
+ * mmap()ing exactly that many pages at page offset N times that. The
+ * kernel only ever advances head and userspace only ever advances tail;
+ * both are free running byte counts, reduced modulo size to index the
+ * data area. Everything but tail is kernel-owned: values written there
+ * are overwritten, and a tail outside [head - size, head] is taken as
+ * the nearest end. poll() reports POLLIN while any ring has unread
+ * records.
+ */
+#define NVFS_RING_VERSION	3
+
+struct nvfs_ring_header {
+	__u32	version;
+	__u32	size;		/* bytes in the data area, a power of two */
+	__u64	dropped;	/* records lost because the ring was full */
+	__u64	head __attribute__((aligned(64)));
+	__u64	tail __attribute__((aligned(64)));
+};
+
+/*
+ * A record is followed by the name of the dentry it applies to and then
+ * by the name of the second dentry, if any, neither NUL terminated. The
+ * whole is padded to a multiple of 8 bytes, which is what size says. A
+ * record with op NVFS_OP_none is padding up to the end of the data area.
+ * result, isize and mtime are only filled in for NVFS_EVF_POST records,
+ * and then describe the inode as the operation left it. offset2 is the
+ * source offset of a copy or clone, whose source is the second dentry.
+ */
+struct nvfs_ring_record {
+	__u16	size;
+	__u16	op;		/* NVFS_OP_* */
+	__u16	flags;
+	__u8	name_len;
+	__u8	name2_len;
+	__u32	dev;		/* lower st_dev */
+	__u32	mode;		/* mode, open flags or ia_valid */
+	__s32	result;		/* 0 or a negative errno, or a byte count */
+	__u32	mtime_nsec;
+	__u64	ino;		/* inode the op applies to */
+	__u64	dentry_ino;	/* inode of the named dentry, 0 if negative */
+	__u64	offset;
+	__u64	count;
+	__u64	isize;
+	__s64	mtime;
+	__u64	offset2;
+};
+
+/*
+ * Dirty extents of a regular file, fetched and reset by issuing
+ * NVFS_IOC_DIRTY_FETCH on any open file descriptor for it. extents
+ * points at room for count of them; on return count says how many were
+ * filled in, lowest first. An extent's end is exclusive.
+ */
+struct nvfs_extent {
+	__u64	start;
+	__u64	end;
+};
+
+#define NVFS_DIRTY_UNKNOWN	0x0001	/* changes before now not tracked */
+#define NVFS_DIRTY_TRUNCATED	0x0002	/* cut, to size at its shortest */
+#define NVFS_DIRTY_MORE		0x0004	/* extents left for the next call */
+
+struct nvfs_dirty_fetch {
+	__u64	extents;	/* struct nvfs_extent * */
+	__u32	count;
+	__u32	flags;		/* NVFS_DIRTY_* */
+	__u64	size;
+};
+
+#define NVFS_IOC_DIRTY_FETCH	_IOWR('N', 0x80, struct nvfs_dirty_fetch)
+
+/*
+ * Give an open file a write combining buffer of the given size in bytes,
+ * so that small sequential writes reach the lower file together. Once
+ * per open file; the buffer is kept until the file is closed.
+ */
+#define NVFS_IOC_WCOMBINE	_IOW('N', 0x81, __u32)
+
+#endif /* __NVFS_USER_H_ */
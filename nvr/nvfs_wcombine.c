@@ -0,0 +1,321 @@
+#include "nvfs.h"
+#include <asm/uaccess.h>
+
+/*
+ * Write combining. A file opened for writing may ask, with
+ * NVFS_IOC_WCOMBINE, for a buffer of its own that small writes are
+ * copied into instead of being passed down one at a time. A write is
+ * absorbed as long as it starts where the last one ended and fits in
+ * what is left of the buffer. The buffer goes to the lower file as one
+ * write when a write cannot be absorbed, and before any other operation
+ * on the file that could tell the difference: read, seek, mmap, fsync
+ * and flush on close among them. That one write is what events and the
+ * dirty extents see, flagged NVFS_EVF_COALESCED; raw ->write callbacks
+ * are still called for every write(2), since they are given its buffer.
+ *
+ * Every buffer of an inode is also written out before its size is
+ * changed or read, by setattr and getattr, so a truncate never has
+ * buffered data land behind it and stat sees the size the writes made.
+ * Otherwise, as with a stdio buffer, buffered data is seen through no
+ * other file, and an error writing it out is returned by whichever call
+ * flushed it. A file that appends appends the whole buffer at the end of
+ * the file as it is at the flush.
+ */
+
+static unsigned int nvfs_wcombine_max = 1 << 16;
+module_param(nvfs_wcombine_max, uint, 0644);
+MODULE_PARM_DESC(nvfs_wcombine_max,
+		"Largest write combining buffer per open file");
+
+struct nvfs_wcombine {
+	struct list_head list;		/* on wii_wcombine */
+	struct file	*file;
+	struct mutex	lock;
+	size_t		size;
+	size_t		len;		/* bytes buffered */
+	loff_t		pos;		/* file offset of buf[0] */
+	char		buf[0];
+};
+
+/**
+ * nvfs_kernel_write - write a kernel buffer to the lower file
+ * @file: lower file
+ * @buf: data
+ * @count: bytes in @buf
+ * @pos: where to write, advanced past what was written
+ */
+static ssize_t
+nvfs_kernel_write(struct file *file, const char *buf, size_t count,
+		loff_t *pos)
+{
+	ssize_t		err;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0)
+	mm_segment_t	old_fs = get_fs();
+
+	ENTER;
+	set_fs(KERNEL_DS);
+	err = vfs_write(file, (const char __user *)buf, count, pos);
+	set_fs(old_fs);
+#else
+	ENTER;
+	err = kernel_write(file, buf, count, pos);
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(4,14,0) */
+
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_wcombine_out - write out a file's buffer
+ * @file: nvfs file
+ * @wc: its buffer, lock held
+ *
+ * The buffer is empty afterwards whatever happened; what did not make it
+ * to the lower file is lost, as after a failed fflush.
+ */
+static int
+nvfs_wcombine_out(struct file *file, struct nvfs_wcombine *wc)
+{
+	int		coalesced;
+	ssize_t		err = 0;
+	loff_t		pos = wc->pos;
+	struct file	*lower_file = FILE_TO_LOWER(file);
+	struct inode	*inode = file->f_dentry->d_inode,
+			*lower_inode = INODE_TO_LOWER(inode);
+
+	ENTER;
+
+	if (!wc->len)
+		goto out;
+
+	/* an appending lower file writes at its own end */
+	if (lower_file->f_flags & O_APPEND)
+		pos = i_size_read(lower_inode);
+	wc->pos = pos;
+
+	coalesced = nvfs_coalesce_wants(wc->len);
+	if (!coalesced)
+		NVFS_EVENT(write, file->f_dentry, lower_inode,
+				lower_file->f_dentry,
+				.flags = NVFS_EVF_COALESCED,
+				.offset = wc->pos, .count = wc->len);
+	err = nvfs_kernel_write(lower_file, wc->buf, wc->len, &pos);
+	if (coalesced)
+		nvfs_coalesce_write(inode, file->f_dentry, wc->pos, wc->len,
+				err, NVFS_EVF_COALESCED);
+	else
+		NVFS_EVENT_POST(write, err, file->f_dentry, lower_inode,
+				lower_file->f_dentry,
+				.flags = NVFS_EVF_COALESCED,
+				.offset = wc->pos, .count = wc->len);
+
+	if (err > 0) {
+		nvfs_copy_attr_timesizes(inode, lower_inode);
+		nvfs_dirty_add(inode, pos - err, pos);
+	}
+	if (err >= 0)
+		err = err < wc->len ? -EIO : 0;
+	wc->len = 0;
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_wcombine_write - absorb a write into a file's buffer if it can be
+ * @file: nvfs file
+ * @buf: data (the iterator from 4.1 on)
+ * @count: bytes in @buf
+ * @ppos: offset of the write, advanced past it if it is absorbed
+ * @append: the write goes at the end of the file
+ * @pass: the write must reach the lower file now (direct, sync, async)
+ *
+ * Returns @count if the write was absorbed, or a negative errno if the
+ * buffer could not be written out ahead of it. Otherwise returns 0, and
+ * the caller passes the write down itself; anything that was buffered
+ * has gone down first.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+ssize_t
+nvfs_wcombine_write(struct file *file, const char __user *buf,
+		size_t count, loff_t *ppos, int append, int pass)
+#else
+ssize_t
+nvfs_wcombine_write(struct file *file, struct iov_iter *buf,
+		size_t count, loff_t *ppos, int append, int pass)
+#endif /* LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0) */
+{
+	ssize_t			err = 0;
+	struct nvfs_wcombine	*wc =
+		ACCESS_ONCE(FILE_TO_PRIVATE(file)->wfi_wcombine);
+	struct file		*lower_file = FILE_TO_LOWER(file);
+
+	ENTER;
+
+	if (!wc || !count)
+		goto out;
+
+	mutex_lock(&wc->lock);
+	/* the buffer appends exactly when the lower file does */
+	pass = pass || !append != !(lower_file->f_flags & O_APPEND) ||
+		(file->f_flags & O_DSYNC) || IS_SYNC(file->f_dentry->d_inode);
+	if (pass || count > wc->size - wc->len ||
+	    (!append && wc->len && *ppos != wc->pos + wc->len)) {
+		err = nvfs_wcombine_out(file, wc);
+		if (err || pass || count > wc->size)
+			goto out_unlock;
+	}
+
+	if (!wc->len)
+		wc->pos = *ppos;
+	/* where it should land if nobody else appends first */
+	if (append)
+		*ppos = i_size_read(INODE_TO_LOWER(file->f_dentry->d_inode)) +
+			wc->len;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,1,0)
+	if (copy_from_user(wc->buf + wc->len, buf, count)) {
+#else
+	if (copy_from_iter(wc->buf + wc->len, count, buf) != count) {
+#endif
+		err = -EFAULT;
+		goto out_unlock;
+	}
+	wc->len += count;
+	*ppos += count;
+	err = count;
+out_unlock:
+	mutex_unlock(&wc->lock);
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_wcombine_flush - write out a file's buffer, if it has one
+ * @file: nvfs file
+ */
+int
+nvfs_wcombine_flush(struct file *file)
+{
+	int			err = 0;
+	struct nvfs_wcombine	*wc =
+		ACCESS_ONCE(FILE_TO_PRIVATE(file)->wfi_wcombine);
+
+	ENTER;
+
+	if (!wc)
+		goto out;
+
+	mutex_lock(&wc->lock);
+	err = nvfs_wcombine_out(file, wc);
+	mutex_unlock(&wc->lock);
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_wcombine_flush_inode - write out every buffer of an inode
+ * @inode: nvfs inode
+ *
+ * Returns the first error, after trying them all.
+ */
+int
+nvfs_wcombine_flush_inode(struct inode *inode)
+{
+	int			err = 0,
+				out_err;
+	struct nvfs_inode_info	*wi = INODE_TO_PRIVATE(inode);
+	struct nvfs_wcombine	*wc;
+
+	ENTER;
+
+	if (list_empty(&wi->wii_wcombine))
+		goto out;
+
+	mutex_lock(&wi->wii_wc_mutex);
+	list_for_each_entry(wc, &wi->wii_wcombine, list) {
+		mutex_lock(&wc->lock);
+		out_err = nvfs_wcombine_out(wc->file, wc);
+		mutex_unlock(&wc->lock);
+		if (!err)
+			err = out_err;
+	}
+	mutex_unlock(&wi->wii_wc_mutex);
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_wcombine_set - NVFS_IOC_WCOMBINE, give a file a buffer
+ * @file: nvfs file, open for writing
+ * @size: buffer size, capped at nvfs_wcombine_max
+ *
+ * A buffer is set up once and kept until the file is released, so the
+ * I/O paths never see it change under them. Files open for direct or
+ * synchronous I/O cannot have one.
+ */
+int
+nvfs_wcombine_set(struct file *file, unsigned int size)
+{
+	int			err = -EINVAL;
+	struct nvfs_inode_info	*wi =
+		INODE_TO_PRIVATE(file->f_dentry->d_inode);
+	struct nvfs_wcombine	*wc;
+
+	ENTER;
+
+	if (!S_ISREG(file->f_dentry->d_inode->i_mode) ||
+	    !(file->f_mode & FMODE_WRITE) ||
+	    (file->f_flags & (O_DIRECT | O_DSYNC)))
+		goto out;
+	size = MIN(size, nvfs_wcombine_max);
+	if (!size)
+		goto out;
+
+	err = -ENOMEM;
+	wc = kmalloc(sizeof(*wc) + size, GFP_KERNEL);
+	if (!wc)
+		goto out;
+	mutex_init(&wc->lock);
+	wc->file = file;
+	wc->size = size;
+	wc->len = 0;
+	wc->pos = 0;
+
+	err = 0;
+	if (cmpxchg(&FILE_TO_PRIVATE(file)->wfi_wcombine, NULL, wc)) {
+		kfree(wc);
+		err = -EBUSY;
+		goto out;
+	}
+	mutex_lock(&wi->wii_wc_mutex);
+	list_add(&wc->list, &wi->wii_wcombine);
+	mutex_unlock(&wi->wii_wc_mutex);
+out:
+	EXIT_RET(err);
+}
+
+/**
+ * nvfs_wcombine_release - write out and free a file's buffer
+ * @file: nvfs file being released
+ *
+ * An error here has nowhere to go; close(2) has had its chance to
+ * report one through ->flush.
+ */
+void
+nvfs_wcombine_release(struct file *file)
+{
+	struct nvfs_inode_info	*wi =
+		INODE_TO_PRIVATE(file->f_dentry->d_inode);
+	struct nvfs_wcombine	*wc = FILE_TO_PRIVATE(file)->wfi_wcombine;
+
+	ENTER;
+
+	if (wc) {
+		mutex_lock(&wi->wii_wc_mutex);
+		list_del(&wc->list);
+		mutex_unlock(&wi->wii_wc_mutex);
+		nvfs_wcombine_out(file, wc);
+		kfree(wc);
+	}
+
+	EXIT_NORET;
+}